@@ -0,0 +1,239 @@
+//! End-to-end throughput benchmark of the worker.
+//!
+//! Runs a worker against a mock agent in the same process, and measures the
+//! job throughput and the round trip latency of each job (from the agent
+//! sending the job to it receiving the result). The benchmark sweeps the
+//! transport, the state dimension, the cost of the likelihood, the number of
+//! evaluator threads and the prefetch window, and prints one tab separated
+//! row per configuration to stdout. The worker logs to stderr, so the table
+//! can be piped on as it is.
+//!
+//! \file bench_worker.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "stateline/worker.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct Config
+{
+  std::string transport;
+  std::size_t dim;
+  unsigned int costUs;
+  unsigned int threads;
+  unsigned int prefetch;
+};
+
+struct Result
+{
+  double jobsPerSec;
+  double p50Us;
+  double p99Us;
+};
+
+//! A stand-in for stateline-agent that hands out a fixed number of jobs.
+//!
+//! Speaks the worker side of the Stateline protocol: answers each hello
+//! (type 1) with as many jobs (type 2) as the worker's prefetch window, and
+//! each result (type 5) with another job until all the jobs have been sent.
+//!
+class MockAgent
+{
+public:
+  MockAgent(zmq::context_t& ctx, const std::string& address, std::size_t dim, std::size_t numJobs)
+    : socket_{ctx, ZMQ_ROUTER}
+    , dim_{dim}
+    , numJobs_{numJobs}
+    , sentAt_(numJobs)
+    , latencies_(numJobs)
+  {
+    socket_.bind(address);
+  }
+
+  //! Serve jobs until every job has a result.
+  Result run()
+  {
+    std::vector<zmq::message_t> envelope;
+    Clock::time_point start;
+    std::size_t numResults = 0;
+
+    while (numResults < numJobs_)
+    {
+      // The envelope is every frame up to and including the empty delimiter
+      envelope.clear();
+      zmq::message_t payload;
+      while (true)
+      {
+        socket_.recv(&payload);
+        if (!payload.more())
+          break;
+
+        envelope.emplace_back(std::move(payload));
+        payload = zmq::message_t{};
+      }
+
+      const auto now = Clock::now();
+      const auto data = static_cast<const char*>(payload.data());
+
+      std::uint32_t numToSend = 1;
+      if (data[0] == 1)
+      {
+        if (nextJob_ == 0)
+          start = now;
+
+        // An extended hello carries the prefetch window after the job types
+        if (payload.size() > 9)
+          memcpy(&numToSend, data + 9, sizeof(numToSend));
+      }
+      else if (data[0] == 5)
+      {
+        std::uint32_t id;
+        memcpy(&id, data + 1, sizeof(id));
+        latencies_[numResults++] = std::chrono::duration<double, std::micro>(now - sentAt_[id]).count();
+      }
+
+      for (std::uint32_t i = 0; i < numToSend && nextJob_ < numJobs_; i++)
+        sendJob(envelope);
+    }
+
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::sort(latencies_.begin(), latencies_.end());
+    return {
+      numJobs_ / elapsed,
+      latencies_[latencies_.size() / 2],
+      latencies_[latencies_.size() * 99 / 100]
+    };
+  }
+
+private:
+  void sendJob(const std::vector<zmq::message_t>& envelope)
+  {
+    for (const auto& frame : envelope)
+    {
+      zmq::message_t copy;
+      copy.copy(const_cast<zmq::message_t*>(&frame));
+      socket_.send(copy, ZMQ_SNDMORE);
+    }
+
+    const std::uint32_t id = nextJob_++;
+    const std::uint32_t type = 0;
+
+    zmq::message_t job{9 + dim_ * sizeof(double)};
+    auto buf = static_cast<char*>(job.data());
+    buf[0] = 2;
+    memcpy(buf + 1, &id, sizeof(id));
+    memcpy(buf + 5, &type, sizeof(type));
+    std::fill(buf + 9, buf + job.size(), 0);
+
+    sentAt_[id] = Clock::now();
+    socket_.send(job);
+  }
+
+  zmq::socket_t socket_;
+  std::size_t dim_;
+  std::size_t numJobs_;
+  std::size_t nextJob_ = 0;
+  std::vector<Clock::time_point> sentAt_;
+  std::vector<double> latencies_;
+};
+
+//! A likelihood that reads the whole state and then spins for a fixed time.
+struct SpinNll
+{
+  double operator()(stateline::JobType, stateline::StateView x) const
+  {
+    double sum = 0.0;
+    for (auto i : x)
+      sum += i;
+
+    const auto end = Clock::now() + std::chrono::microseconds(costUs);
+    while (Clock::now() < end)
+      ;
+
+    return sum;
+  }
+
+  unsigned int costUs;
+};
+
+Result runBenchmark(const Config& config, std::size_t numJobs)
+{
+  zmq::context_t ctx{stateline::detail::NUM_IO_THREADS};
+
+  const std::string address = config.transport == "inproc"
+    ? "inproc://bench-agent"
+    : "ipc:///tmp/stateline-bench-agent-" + std::to_string(::getpid());
+
+  stateline::WorkerOptions options;
+  options.context = &ctx;
+  options.prefetch = config.prefetch;
+
+  std::thread worker;
+  Result result;
+  {
+    // The agent must be bound before the worker connects over inproc
+    MockAgent agent{ctx, address, config.dim, numJobs};
+
+    worker = std::thread{[&]
+    {
+      if (config.threads > 1)
+        stateline::runWorkerPool(address, SpinNll{config.costUs}, config.threads, options);
+      else
+        stateline::runWorker(address, SpinNll{config.costUs}, options);
+    }};
+
+    result = agent.run();
+  }
+
+  // Terminating the context stops the worker
+  ctx.close();
+  worker.join();
+
+  return result;
+}
+
+int main(int argc, const char *argv[])
+{
+  std::size_t numJobs = 20000;
+  if (argc > 1)
+    numJobs = std::stoul(argv[1]);
+
+  std::vector<Config> configs;
+  for (const std::string transport : {"inproc", "ipc"})
+    for (const std::size_t dim : {10, 1000})
+      for (const unsigned int costUs : {0, 50})
+        for (const unsigned int threads : {1, 4})
+          for (const unsigned int prefetch : {1, 8})
+            configs.push_back({transport, dim, costUs, threads, prefetch});
+
+  std::vector<Result> results;
+  for (const auto& config : configs)
+    results.push_back(runBenchmark(config, numJobs));
+
+  std::cout << "transport\tdim\tcost_us\tthreads\tprefetch\tjobs_per_sec\tp50_us\tp99_us" << std::endl;
+  std::cout << std::fixed << std::setprecision(1);
+  for (std::size_t i = 0; i < configs.size(); i++)
+  {
+    const auto& config = configs[i];
+    const auto& result = results[i];
+    std::cout << config.transport << "\t" << config.dim << "\t" << config.costUs << "\t"
+              << config.threads << "\t" << config.prefetch << "\t"
+              << result.jobsPerSec << "\t" << result.p50Us << "\t" << result.p99Us << std::endl;
+  }
+}
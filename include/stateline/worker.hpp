@@ -9,14 +9,42 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <csignal>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <future>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <cppzmq/zmq.hpp>
 
 namespace stateline
@@ -25,207 +53,2818 @@ namespace stateline
 using JobID = unsigned int;
 using JobType = unsigned int;
 
-namespace detail
+//! A read-only view of a contiguous array of doubles, such as the state of a job.
+//!
+//! Likelihood functions that take a StateView instead of a std::vector<double>
+//! read the state straight out of the received message whenever possible, so
+//! no memory is allocated per job.
+//!
+class StateView
 {
+public:
+  StateView(const double* data, std::size_t size)
+    : data_{data}
+    , size_{size}
+  {
+  }
 
-constexpr int NUM_IO_THREADS = 2;
+  const double* data() const { return data_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
 
-template <class... Args>
-struct PackSize;
+  const double* begin() const { return data_; }
+  const double* end() const { return data_ + size_; }
 
-template <class T, class... Args>
-struct PackSize<T, Args...>
+  const double& operator[](std::size_t i) const { return data_[i]; }
+
+private:
+  const double* data_;
+  std::size_t size_;
+};
+
+//! Counters describing how well the prefetch window hides the round trip to
+//! the agent. They can be read from any thread while the worker is running.
+//!
+struct PipelineStats
 {
-  static constexpr std::size_t value = sizeof(T) + PackSize<Args...>::value;
+  //! Number of jobs evaluated so far.
+  std::atomic<std::uint64_t> jobs{0};
+
+  //! Number of times the worker had no job queued and had to wait for the agent.
+  std::atomic<std::uint64_t> stalls{0};
+
+  //! Number of job messages (single jobs or batches) currently held by the
+  //! worker, whether queued or being evaluated.
+  std::atomic<unsigned int> inFlight{0};
+
+  //! The largest value of inFlight seen so far.
+  std::atomic<unsigned int> maxInFlight{0};
 };
 
-template <>
-struct PackSize<> { static constexpr std::size_t value = 0; };
+//! A bounded cache of likelihood results, keyed on the job type and the exact
+//! bytes of the state.
+//!
+//! The cache lives in a fixed memory budget that is allocated the first time a
+//! result is inserted. Every key must have the same dimension as that first
+//! state; states of another dimension bypass the cache. Lookups use open
+//! addressing over a short probe window, and a full window evicts an entry
+//! using the CLOCK (second chance) policy. The cache is thread-safe, so one
+//! cache can be shared by all the threads of a worker pool.
+//!
+//! The cache only pays off when the likelihood is much more expensive than
+//! hashing and comparing a state.
+//!
+class ResultCache
+{
+public:
+  //! Constructs an empty cache.
+  //!
+  //! \param budget The memory budget of the cache in bytes.
+  //!
+  explicit ResultCache(std::size_t budget)
+    : budget_{budget}
+  {
+  }
+
+  ResultCache(const ResultCache&) = delete;
+
+  //! Look up the result of a job.
+  //!
+  //! \param type The job type.
+  //! \param state The bytes of the state. Need not be aligned.
+  //! \param length The number of doubles in the state.
+  //! \param result Set to the cached result when one is found.
+  //! \return Whether a cached result was found.
+  //!
+  bool find(JobType type, const char* state, std::size_t length, double& result)
+  {
+    const auto hash = hashState(type, state, length);
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (length == dim_ && !slots_.empty())
+    {
+      const std::size_t start = hash & (slots_.size() - 1);
+      for (std::size_t i = 0; i < PROBE_LENGTH; i++)
+      {
+        const std::size_t index = (start + i) & (slots_.size() - 1);
+        Slot& slot = slots_[index];
+        if (slot.used && slot.hash == hash && slot.type == type &&
+            memcmp(&keys_[index * dim_], state, length * sizeof(double)) == 0)
+        {
+          slot.referenced = true;
+          result = slot.result;
+          hits_++;
+          return true;
+        }
+      }
+    }
+
+    misses_++;
+    return false;
+  }
+
+  //! Store the result of a job, evicting an older result if necessary.
+  //!
+  //! \param type The job type.
+  //! \param state The bytes of the state. Need not be aligned.
+  //! \param length The number of doubles in the state.
+  //! \param result The likelihood of the state.
+  //!
+  void insert(JobType type, const char* state, std::size_t length, double result)
+  {
+    const auto hash = hashState(type, state, length);
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (dim_ == 0 && length > 0)
+      allocate(length);
+
+    if (length != dim_ || slots_.empty())
+      return;
+
+    // Reuse a free slot or the slot already holding this key (another thread
+    // may have evaluated the same state concurrently), otherwise evict one.
+    const std::size_t start = hash & (slots_.size() - 1);
+    std::size_t index = slots_.size();
+    for (std::size_t i = 0; i < PROBE_LENGTH && index == slots_.size(); i++)
+    {
+      const std::size_t probe = (start + i) & (slots_.size() - 1);
+      const Slot& slot = slots_[probe];
+      if (!slot.used || (slot.hash == hash && slot.type == type &&
+                         memcmp(&keys_[probe * dim_], state, length * sizeof(double)) == 0))
+      {
+        index = probe;
+      }
+    }
+
+    if (index == slots_.size())
+      index = evict(start);
+
+    Slot& slot = slots_[index];
+    slot.hash = hash;
+    slot.type = type;
+    slot.result = result;
+    slot.used = true;
+    slot.referenced = true;
+    memcpy(&keys_[index * dim_], state, length * sizeof(double));
+  }
+
+  //! Number of lookups that found a cached result.
+  std::uint64_t hits() const { return hits_; }
+
+  //! Number of lookups that did not find a cached result.
+  std::uint64_t misses() const { return misses_; }
+
+  //! Number of results that were evicted to make room for newer ones.
+  std::uint64_t evictions() const { return evictions_; }
+
+  //! Number of results that fit in the memory budget. Zero until the first insert.
+  std::size_t capacity() const
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return slots_.size();
+  }
+
+private:
+  struct Slot
+  {
+    std::uint64_t hash;
+    JobType type;
+    bool used;
+    bool referenced;
+    double result;
+  };
+
+  //! Number of consecutive slots searched for a key.
+  static constexpr std::size_t PROBE_LENGTH = 8;
+
+  static std::uint64_t hashState(JobType type, const char* state, std::size_t length)
+  {
+    std::uint64_t hash = 0x9e3779b97f4a7c15ull ^ (std::uint64_t{type} << 32) ^ length;
+    for (std::size_t i = 0; i < length; i++)
+    {
+      std::uint64_t word;
+      memcpy(&word, state + i * sizeof(word), sizeof(word));
+
+      // Murmur3 style mixing of each word
+      hash ^= word;
+      hash *= 0xff51afd7ed558ccdull;
+      hash ^= hash >> 33;
+    }
+
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  void allocate(std::size_t dim)
+  {
+    dim_ = dim;
+
+    // Use the largest power of two number of slots that fits in the budget
+    const std::size_t slotSize = sizeof(Slot) + dim * sizeof(double);
+    std::size_t numSlots = 1;
+    while (numSlots * 2 * slotSize <= budget_)
+      numSlots *= 2;
+
+    if (numSlots * slotSize > budget_ || numSlots < PROBE_LENGTH)
+      return;
+
+    slots_.assign(numSlots, Slot{0, 0, false, false, 0.0});
+    keys_.assign(numSlots * dim, 0.0);
+  }
+
+  //! Pick a slot in the probe window starting at start and evict its result.
+  std::size_t evict(std::size_t start)
+  {
+    // Sweep the window clearing reference bits, so a result that was used
+    // since the last sweep gets a second chance.
+    for (std::size_t i = 0; ; i++)
+    {
+      const std::size_t index = (start + (hand_ + i) % PROBE_LENGTH) & (slots_.size() - 1);
+      Slot& slot = slots_[index];
+      if (!slot.referenced)
+      {
+        hand_ = (hand_ + i + 1) % PROBE_LENGTH;
+        evictions_++;
+        return index;
+      }
+
+      slot.referenced = false;
+    }
+  }
+
+  std::size_t budget_;
+  std::size_t dim_ = 0;
+  std::size_t hand_ = 0;
+  std::vector<Slot> slots_;
+  std::vector<double> keys_;
+  mutable std::mutex mutex_;
+
+  std::atomic<std::uint64_t> hits_{0};
+  std::atomic<std::uint64_t> misses_{0};
+  std::atomic<std::uint64_t> evictions_{0};
+};
 
-char* packBuffer(char* buf)
+namespace detail
 {
-  return buf;
-}
 
-template <class T, class... Args>
-char* packBuffer(char* buf, T val, Args... args)
+constexpr int NUM_IO_THREADS = 2;
+
+using Clock = std::chrono::steady_clock;
+
+inline std::uint64_t nanosecondsSince(Clock::time_point start, Clock::time_point end = Clock::now())
 {
-  memcpy(buf, reinterpret_cast<char*>(&val), sizeof(val));
-  return packBuffer(buf + sizeof(val), args...);
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
 }
 
-template <class... Args>
-std::array<char, PackSize<Args...>::value> packArray(Args... args)
+// Latencies are bucketed HDR style: each power of two range of nanoseconds is
+// split into 2^SUB_BUCKET_BITS linear buckets, for a resolution of about 12%.
+constexpr unsigned int SUB_BUCKET_BITS = 3;
+constexpr unsigned int MAX_LATENCY_EXPONENT = 42; // 2^42 ns is over an hour
+constexpr std::size_t NUM_LATENCY_BUCKETS =
+  std::size_t{MAX_LATENCY_EXPONENT - SUB_BUCKET_BITS + 1} << SUB_BUCKET_BITS;
+
+inline std::size_t latencyBucket(std::uint64_t ns)
 {
-  std::array<char, PackSize<Args...>::value> buffer;
-  packBuffer(buffer.data(), args...);
-  return buffer;
+  if (ns < (1u << SUB_BUCKET_BITS))
+    return ns;
+
+  const unsigned int exponent = 63 - __builtin_clzll(ns);
+  if (exponent >= MAX_LATENCY_EXPONENT)
+    return NUM_LATENCY_BUCKETS - 1;
+
+  const std::size_t sub = (ns >> (exponent - SUB_BUCKET_BITS)) & ((1u << SUB_BUCKET_BITS) - 1);
+  return ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + sub;
 }
 
-// TODO: there's gotta be a better way of doing this
-template <class... Args>
-typename std::enable_if<
-  sizeof...(Args) == 0,
-  std::pair<std::tuple<>, const char*>
->::type unpackBuffer(const char* buf)
+//! The value in the middle of a latency bucket, in nanoseconds.
+inline double latencyBucketMidpoint(std::size_t bucket)
 {
-  return {{}, buf};
+  if (bucket < (1u << SUB_BUCKET_BITS))
+    return bucket;
+
+  const unsigned int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+  const std::uint64_t lower = ((bucket & ((1u << SUB_BUCKET_BITS) - 1)) | (1u << SUB_BUCKET_BITS)) << shift;
+  return lower + ((std::uint64_t{1} << shift) - 1) / 2.0;
 }
 
-template <class T, class... Args>
-std::pair<std::tuple<T, Args...>, const char*> unpackBuffer(const char* buf)
+//! The most job types that a worker keeps latency histograms for. Jobs of the
+//! other types only count towards the totals.
+constexpr std::size_t MAX_METRICS_JOB_TYPES = 64;
+
+//! A lock-free histogram of latencies.
+struct LatencyHistogram
 {
-  T val = *reinterpret_cast<const T*>(buf);
+  void record(std::uint64_t ns)
+  {
+    counts[latencyBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic<std::uint64_t>, NUM_LATENCY_BUCKETS> counts{};
+};
 
-  auto result = unpackBuffer<Args...>(buf + sizeof(T));
-  return {
-      std::tuple_cat(std::tuple<T>(val), result.first),
-      result.second
+//! The metrics recorded by a single evaluator thread. Sharding the metrics
+//! per thread keeps the threads of a pool from contending on the counters.
+struct MetricsShard
+{
+  struct Type
+  {
+    std::atomic<std::uint64_t> jobs{0};
+    LatencyHistogram recv;
+    LatencyHistogram nll;
+    LatencyHistogram send;
   };
+
+  MetricsShard(JobType from, std::size_t numTypes)
+    : from{from}
+    , types(numTypes)
+  {
+  }
+
+  //! The metrics of a job type, or null if the type is not being tracked.
+  Type* find(JobType type)
+  {
+    return type >= from && type - from < types.size() ? &types[type - from] : nullptr;
+  }
+
+  JobType from;
+  std::vector<Type> types;
+
+  std::atomic<std::uint64_t> jobs{0};
+  std::atomic<std::uint64_t> bytesIn{0};
+  std::atomic<std::uint64_t> bytesOut{0};
+  std::atomic<std::uint64_t> idleNs{0};
+};
+
+inline void add(std::atomic<std::uint64_t>& counter, std::uint64_t value)
+{
+  counter.fetch_add(value, std::memory_order_relaxed);
 }
 
-//! Thin wrapper around a IPC socket to connect to the server and send messages.
+}
+
+//! Summary of a latency histogram. Times are in microseconds.
+struct LatencySummary
+{
+  std::uint64_t count = 0;
+  double mean = 0;
+  double p50 = 0;
+  double p90 = 0;
+  double p99 = 0;
+  double max = 0;
+};
+
+//! Metrics of a single job type.
+struct JobTypeMetrics
+{
+  JobType type;
+  std::uint64_t jobs;
+
+  //! Time spent receiving a job, including waiting for it to arrive.
+  LatencySummary recv;
+
+  //! Time spent evaluating the likelihood of a message (a job or a batch).
+  LatencySummary nll;
+
+  //! Time spent sending a result.
+  LatencySummary send;
+};
+
+//! A point in time view of a worker's metrics.
+struct MetricsSnapshot
+{
+  //! Seconds since the metrics were created.
+  double uptime = 0;
+
+  //! Number of jobs evaluated.
+  std::uint64_t jobs = 0;
+
+  //! Number of bytes received from and sent to the agent.
+  std::uint64_t bytesIn = 0;
+  std::uint64_t bytesOut = 0;
+
+  //! Seconds spent blocked waiting for the agent, summed over the threads.
+  double idle = 0;
+
+  //! Metrics of each job type that has received jobs.
+  std::vector<JobTypeMetrics> types;
+};
+
+//! Latency histograms and throughput counters of a worker.
 //!
-class IpcSocket
+//! Every evaluator thread records into its own shard using relaxed atomic
+//! increments, which keeps the overhead to a handful of clock reads and
+//! uncontended increments per job. snapshot() can be called from any thread
+//! to merge the shards.
+//!
+class WorkerMetrics
 {
 public:
-  //! Constructs a new IPC socket.
+  //! Creates empty metrics.
   //!
-  //! \param numIOThreads Number of threads to use for IO. Should be at least one.
+  //! \param from The first job type to keep latency histograms for.
+  //! \param to The last job type (inclusive) to keep latency histograms for.
+  //!           Only the first 64 types of the range get histograms.
   //!
-  IpcSocket(int numIOThreads)
-    : ctx_{numIOThreads}
-    , socket_{ctx_, ZMQ_REQ}
+  //! \throws std::invalid_argument if to is less than from.
+  //!
+  explicit WorkerMetrics(JobType from = 0, JobType to = 0)
+    : from_{from}
+    , start_{detail::Clock::now()}
   {
+    if (to < from)
+      throw std::invalid_argument("Invalid job type range");
+
+    numTypes_ = std::min<std::size_t>(std::size_t{to} - from + 1, detail::MAX_METRICS_JOB_TYPES);
   }
 
-  IpcSocket(const IpcSocket&) = delete;
+  WorkerMetrics(const WorkerMetrics&) = delete;
 
-  //! Connect to a host.
-  //!
-  //! \param address The address of the host.
-  //!
-  void connect(const std::string& address)
+  //! Merge the metrics of all the threads.
+  MetricsSnapshot snapshot() const
   {
-    socket_.connect(address);
+    MetricsSnapshot result;
+    result.uptime = detail::nanosecondsSince(start_) * 1e-9;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (const auto& shard : shards_)
+    {
+      result.jobs += shard->jobs.load(std::memory_order_relaxed);
+      result.bytesIn += shard->bytesIn.load(std::memory_order_relaxed);
+      result.bytesOut += shard->bytesOut.load(std::memory_order_relaxed);
+      result.idle += shard->idleNs.load(std::memory_order_relaxed) * 1e-9;
+    }
+
+    // Only merge the histograms of the types that have received jobs
+    Histogram recv, nll, send;
+    for (std::size_t t = 0; t < numTypes_; t++)
+    {
+      std::uint64_t jobs = 0;
+      for (const auto& shard : shards_)
+        jobs += shard->types[t].jobs.load(std::memory_order_relaxed);
+
+      if (jobs == 0)
+        continue;
+
+      recv.fill(0);
+      nll.fill(0);
+      send.fill(0);
+      for (const auto& shard : shards_)
+      {
+        const auto& type = shard->types[t];
+        for (std::size_t b = 0; b < detail::NUM_LATENCY_BUCKETS; b++)
+        {
+          recv[b] += type.recv.counts[b].load(std::memory_order_relaxed);
+          nll[b] += type.nll.counts[b].load(std::memory_order_relaxed);
+          send[b] += type.send.counts[b].load(std::memory_order_relaxed);
+        }
+      }
+
+      result.types.push_back({
+        static_cast<JobType>(from_ + t), jobs,
+        summarise(recv), summarise(nll), summarise(send)
+      });
+    }
+
+    return result;
   }
 
-  //! Send a buffer. connect() must be called prior to calling this method.
-  //!
-  //! \params data The bytes to send.
-  //!
-  void send(const char* buf, std::size_t size)
+  //! Add a shard for an evaluator thread. The shard lives as long as the metrics.
+  detail::MetricsShard& addShard()
   {
-    // Send the payload message
-    zmq::message_t msg{size};
-    memcpy(msg.data(), buf, size);
-    socket_.send(msg);
+    std::lock_guard<std::mutex> lock{mutex_};
+    shards_.emplace_back(new detail::MetricsShard{from_, numTypes_});
+    return *shards_.back();
   }
 
-  std::string recv()
+private:
+  using Histogram = std::array<std::uint64_t, detail::NUM_LATENCY_BUCKETS>;
+
+  static LatencySummary summarise(const Histogram& counts)
   {
-    zmq::message_t msg;
-    socket_.recv(&msg);
-    return {static_cast<char *>(msg.data()), msg.size()}; // TODO: can we eliminate the copy here?
+    LatencySummary summary;
+
+    double total = 0;
+    for (std::size_t b = 0; b < counts.size(); b++)
+    {
+      summary.count += counts[b];
+      total += counts[b] * detail::latencyBucketMidpoint(b);
+    }
+
+    if (summary.count == 0)
+      return summary;
+
+    summary.mean = total / summary.count * 1e-3;
+
+    // Walk the buckets until each percentile's rank has been reached
+    const std::uint64_t ranks[] = {
+      (summary.count * 50 + 99) / 100,
+      (summary.count * 90 + 99) / 100,
+      (summary.count * 99 + 99) / 100
+    };
+    double* percentiles[] = { &summary.p50, &summary.p90, &summary.p99 };
+
+    std::uint64_t seen = 0;
+    std::size_t next = 0;
+    for (std::size_t b = 0; b < counts.size(); b++)
+    {
+      if (counts[b] == 0)
+        continue;
+
+      seen += counts[b];
+      while (next < 3 && seen >= ranks[next])
+        *percentiles[next++] = detail::latencyBucketMidpoint(b) * 1e-3;
+
+      summary.max = detail::latencyBucketMidpoint(b) * 1e-3;
+    }
+
+    return summary;
   }
 
-private:
-  zmq::context_t ctx_;
-  zmq::socket_t socket_;
+  JobType from_;
+  std::size_t numTypes_;
+  detail::Clock::time_point start_;
+  std::vector<std::unique_ptr<detail::MetricsShard>> shards_;
+  mutable std::mutex mutex_;
 };
 
-//! Provides a layer above a socket that can understand the Stateline protocol.
+//! Writes metrics snapshots as JSON lines, one object per snapshot.
 //!
-template <class Socket>
-class MessageHandler
+//! Besides the totals, each line has the throughput since the previous line.
+//!
+class JsonMetricsWriter
 {
 public:
-  struct Job
-  {
-    JobID id;
-    JobType type;
-    std::vector<double> data;
-  };
-
-  MessageHandler(Socket& socket)
-    : socket_(socket)
+  explicit JsonMetricsWriter(std::ostream& out)
+    : out_(&out)
   {
   }
 
-  void sendHello(JobType from, JobType to)
+  void operator()(const MetricsSnapshot& snapshot)
   {
-    auto buf = packArray(
-      std::uint8_t{1},                            // Message type
-      std::uint32_t{from},                        // Job type from
-      std::uint32_t{to}                           // Job type to
-    );
+    const double elapsed = snapshot.uptime - previous_.uptime;
+    const double jobsPerSec = elapsed > 0 ? (snapshot.jobs - previous_.jobs) / elapsed : 0;
 
-    socket_.send(buf.data(), buf.size());
+    std::ostream& out = *out_;
+    out << "{\"uptime\":" << snapshot.uptime
+        << ",\"jobs\":" << snapshot.jobs
+        << ",\"jobs_per_sec\":" << jobsPerSec
+        << ",\"bytes_in\":" << snapshot.bytesIn
+        << ",\"bytes_out\":" << snapshot.bytesOut
+        << ",\"idle\":" << snapshot.idle
+        << ",\"types\":[";
+
+    for (std::size_t i = 0; i < snapshot.types.size(); i++)
+    {
+      const auto& type = snapshot.types[i];
+      out << (i > 0 ? "," : "")
+          << "{\"type\":" << type.type
+          << ",\"jobs\":" << type.jobs;
+      writeLatency("recv", type.recv);
+      writeLatency("nll", type.nll);
+      writeLatency("send", type.send);
+      out << "}";
+    }
+
+    out << "]}" << std::endl;
+
+    previous_.uptime = snapshot.uptime;
+    previous_.jobs = snapshot.jobs;
   }
 
-  Job recvJob()
+private:
+  void writeLatency(const char* name, const LatencySummary& summary)
   {
-    // TODO: can we assert the size of the buffer here?
-    const auto buf = socket_.recv();
+    *out_ << ",\"" << name << "_us\":{"
+          << "\"count\":" << summary.count
+          << ",\"mean\":" << summary.mean
+          << ",\"p50\":" << summary.p50
+          << ",\"p90\":" << summary.p90
+          << ",\"p99\":" << summary.p99
+          << ",\"max\":" << summary.max
+          << "}";
+  }
+
+  std::ostream* out_;
+  MetricsSnapshot previous_;
+};
+
+//! A flag that asks a worker to stop.
+//!
+//! When a stop is requested, the worker finishes the jobs it has already
+//! received, sends their results, says goodbye to the agent, and returns.
+//! requestStop() is safe to call from a signal handler.
+//!
+class StopToken
+{
+public:
+  void requestStop() { stop_.store(true); }
+  bool stopRequested() const { return stop_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<bool> stop_{false};
+};
+
+namespace detail
+{
 
-    auto result = unpackBuffer<
-      std::uint8_t,   // Message type
-      std::uint32_t,  // Job ID
-      std::uint32_t   // Job type
-    >(buf.data());
+inline std::atomic<StopToken*>& signalStopToken()
+{
+  static std::atomic<StopToken*> token{nullptr};
+  return token;
+}
 
-    // The remaining bytes in the buffer is the job data
-    const auto numBytesLeft = buf.size() - (result.second - buf.data());
-    assert(numBytesLeft >= 0);
-    assert(numBytesLeft % 8 == 0);
+inline void handleStopSignal(int)
+{
+  if (StopToken* token = signalStopToken().load())
+    token->requestStop();
+}
 
-    const auto jobDataLength = numBytesLeft / 8;
-    std::vector<double> data(jobDataLength);
-    memcpy(data.data(), result.second, numBytesLeft);
+}
 
-    return {
-      std::get<1>(result.first),
-      std::get<2>(result.first),
-      std::move(data)
-    };
+//! Request a stop on a token when the process receives one of the given signals.
+//!
+//! The handlers interrupt blocking socket calls, so an idle worker notices
+//! the stop straight away. Only one token can be attached to signals at a time.
+//! The handlers stay installed for good; use StopSignalGuard to remove them
+//! when the token goes away.
+//!
+//! \param token The token to stop. Must outlive the signal handlers.
+//! \param signals The signals that stop the token.
+//!
+inline void stopOnSignals(StopToken& token, std::initializer_list<int> signals = {SIGINT, SIGTERM})
+{
+  detail::signalStopToken().store(&token);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = detail::handleStopSignal;
+  sigemptyset(&action.sa_mask);
+
+  for (int signal : signals)
+    sigaction(signal, &action, nullptr);
+}
+
+//! Requests a stop on a token when the process receives one of the given
+//! signals, for as long as the guard lives. See stopOnSignals.
+//!
+//! The destructor restores the signal handlers, and the token, that were in
+//! place before the guard was created.
+//!
+class StopSignalGuard
+{
+public:
+  //! \param token The token to stop. Must outlive the guard.
+  //! \param signals The signals that stop the token.
+  //!
+  explicit StopSignalGuard(StopToken& token, std::initializer_list<int> signals = {SIGINT, SIGTERM})
+    : token_{detail::signalStopToken().exchange(&token)}
+  {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = detail::handleStopSignal;
+    sigemptyset(&action.sa_mask);
+
+    for (int signal : signals)
+    {
+      struct sigaction previous;
+      if (sigaction(signal, &action, &previous) == 0)
+        previous_.emplace_back(signal, previous);
+    }
   }
 
-  void sendResult(std::uint32_t id, double data)
+  StopSignalGuard(const StopSignalGuard&) = delete;
+  StopSignalGuard& operator=(const StopSignalGuard&) = delete;
+
+  ~StopSignalGuard()
   {
-    auto buf = packArray(
-      std::uint8_t{5},   // Message type
-      std::uint32_t{id}, // Job ID
-      double{data}       // Data
-    );
+    // Put the handlers back first, so that no signal can reach a detached token
+    for (const auto& previous : previous_)
+      sigaction(previous.first, &previous.second, nullptr);
 
-    socket_.send(buf.data(), buf.size());
+    detail::signalStopToken().store(token_);
   }
 
 private:
-  Socket& socket_;
+  StopToken* token_;
+  std::vector<std::pair<int, struct sigaction>> previous_;
 };
 
-}
+namespace detail
+{
 
-template <class Nll>
-void runWorker(const std::string& address, Nll nll)
+//! Collects the results of asynchronous evaluations from any thread.
+//!
+//! The first result to arrive in an empty queue writes a byte to a pipe, so
+//! that the worker can wait on the pipe and its socket at the same time.
+//!
+class CompletionQueue
 {
-  detail::IpcSocket socket{detail::NUM_IO_THREADS};
-  socket.connect(address);
-  std::cout << "Connected to " << address << std::endl;
+public:
+  //! \throws std::system_error if the pipe cannot be created.
+  CompletionQueue()
+  {
+    // Likelihoods may start other processes, which must not inherit the pipe
+#ifdef __linux__
+    if (::pipe2(fds_, O_CLOEXEC | O_NONBLOCK) != 0)
+      throw std::system_error(errno, std::generic_category(), "Could not create a pipe");
+#else
+    if (::pipe(fds_) != 0)
+      throw std::system_error(errno, std::generic_category(), "Could not create a pipe");
 
-  detail::MessageHandler<detail::IpcSocket> handler{socket};
+    for (int fd : fds_)
+    {
+      if (::fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 || ::fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+      {
+        const int error = errno;
+        ::close(fds_[0]);
+        ::close(fds_[1]);
+        throw std::system_error(error, std::generic_category(), "Could not set up a pipe");
+      }
+    }
+#endif
+  }
+
+  CompletionQueue(const CompletionQueue&) = delete;
+  CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+  ~CompletionQueue()
+  {
+    ::close(fds_[0]);
+    ::close(fds_[1]);
+  }
+
+  //! The end of the pipe that becomes readable when results are waiting.
+  int fd() const { return fds_[0]; }
+
+  void push(std::size_t slot, double result)
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (done_.empty())
+    {
+      const char wake = 0;
+      while (::write(fds_[1], &wake, 1) < 0 && errno == EINTR)
+        ;
+    }
 
-  // Send hello message to initiate the protocol
-  handler.sendHello(0, 0);
+    done_.emplace_back(slot, result);
+    ready_.notify_one();
+  }
 
-  while (true)
+  //! Take every result that has arrived, without waiting.
+  //!
+  //! \param results Replaced by the slots and results, in completion order.
+  //!
+  void take(std::vector<std::pair<std::size_t, double>>& results)
   {
-    const auto job = handler.recvJob();
-    const auto result = nll(job.type, job.data);
+    results.clear();
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    results.swap(done_);
 
-    handler.sendResult(job.id, result);
+    char buf[64];
+    while (::read(fds_[0], buf, sizeof(buf)) > 0)
+      ;
   }
+
+  //! Block until at least one result has arrived.
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock{mutex_};
+    ready_.wait(lock, [this] { return !done_.empty(); });
+  }
+
+private:
+  int fds_[2];
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::vector<std::pair<std::size_t, double>> done_;
+};
+
+}
+
+//! Hands the result of an asynchronous likelihood evaluation back to the worker.
+//!
+//! An asynchronous likelihood is called as `nll(type, state, done)`, starts the
+//! evaluation and returns straight away. It later calls `done(result)` exactly
+//! once, from any thread. The state stays valid until then, so the worker
+//! does not return until every evaluation it has started has completed, even
+//! if it is stopped or its context is terminated.
+//!
+class Completion
+{
+public:
+  //! Created by the worker for each job.
+  Completion(std::shared_ptr<detail::CompletionQueue> queue, std::size_t slot)
+    : queue_{std::move(queue)}
+    , slot_{slot}
+  {
+  }
+
+  void operator()(double result) const
+  {
+    queue_->push(slot_, result);
+  }
+
+private:
+  std::shared_ptr<detail::CompletionQueue> queue_;
+  std::size_t slot_;
+};
+
+//! Options that control how a worker talks to its agent.
+//!
+struct WorkerOptions
+{
+  //! Optional ZMQ context to create the worker's sockets in, for example to
+  //! reach an agent in the same process over inproc. Terminating the context
+  //! stops the worker, but an asynchronous worker still waits for the
+  //! evaluations it has started to complete before it returns. By default the
+  //! worker creates its own context.
+  zmq::context_t* context = nullptr;
+
+  //! Number of ZMQ IO threads in the context that the worker creates. Zero is
+  //! enough if the agent is only reached over inproc. Ignored if context is set.
+  int numIOThreads = detail::NUM_IO_THREADS;
+
+  //! CPUs to pin the ZMQ IO threads to, for example the cores of the NUMA node
+  //! that the network card is attached to. Ignored if context is set, or if
+  //! the ZMQ library cannot set thread affinity.
+  std::vector<int> ioCpus;
+
+  //! CPUs to pin the evaluator threads to. Evaluator thread i of a pool is
+  //! pinned to evaluatorCpus[i % evaluatorCpus.size()], and runWorker pins the
+  //! calling thread to the first one until it returns. Every CPU must be in
+  //! the affinity mask of the calling thread. Only supported on Linux. Empty
+  //! lets the threads migrate freely.
+  std::vector<int> evaluatorCpus;
+
+  //! Number of job messages the agent may send ahead of the one being
+  //! evaluated. A batch counts as a single message. Results double as requests
+  //! for more work, so a window larger than one hides the round trip between
+  //! sending a result and receiving the next job. A window of one keeps the
+  //! original lockstep protocol. For a worker pool, the window applies to each
+  //! evaluator thread.
+  unsigned int prefetch = 1;
+
+  //! Largest number of jobs the agent may pack into one batch message. Batches
+  //! are evaluated with a single call if the likelihood has a batch overload
+  //! (see withBatch), and one job at a time otherwise. Ignored if the
+  //! likelihood returns gradients, as batch results have no gradients, or if
+  //! it is asynchronous.
+  unsigned int maxBatch = 1;
+
+  //! Largest number of evaluations that an asynchronous likelihood (see
+  //! Completion) may have in flight at once, per evaluator thread. The
+  //! prefetch window is raised to at least this many jobs. Ignored for
+  //! likelihoods that block.
+  unsigned int concurrency = 16;
+
+  //! Optional token to stop the worker cleanly. Must outlive the worker.
+  StopToken* stop = nullptr;
+
+  //! While the worker waits for a job, it sends a heartbeat to the agent at
+  //! this interval, and expects any message (such as a heartbeat in reply)
+  //! back. Results count as heartbeats, so a busy worker sends none. Zero
+  //! disables heartbeats.
+  std::chrono::milliseconds heartbeatInterval{0};
+
+  //! If the agent sends nothing for this long while the worker waits for a
+  //! job, the worker drops its connection and the jobs it has queued,
+  //! reconnects and sends a new hello. This recovers from an agent restart
+  //! without losing the worker's state. Zero waits forever. Needs a heartbeat
+  //! interval shorter than the timeout, and an agent that answers heartbeats.
+  std::chrono::milliseconds reconnectTimeout{0};
+
+  //! The range of job types (inclusive) that the worker asks the agent for.
+  //! Ignored when the likelihood is a PerJobType, which asks for its own range.
+  JobType jobTypeFrom = 0;
+  JobType jobTypeTo = 0;
+
+  //! Optional counters that are updated while the worker runs. Must outlive the worker.
+  PipelineStats* stats = nullptr;
+
+  //! Optional latency histograms and throughput counters. Shared by all the
+  //! threads of a worker pool. Must outlive the worker.
+  WorkerMetrics* metrics = nullptr;
+
+  //! If non-zero, onMetrics is called from a background thread with a snapshot
+  //! of the metrics at this interval. If metrics is null, the worker creates
+  //! its own metrics for the requested job types.
+  std::chrono::milliseconds metricsInterval{0};
+
+  //! Receives the periodic metrics snapshots. Writes JSON lines to stderr if empty.
+  std::function<void(const MetricsSnapshot&)> onMetrics;
+
+  //! Optional cache of results that is checked before calling the likelihood.
+  //! Shared by all the threads of a worker pool. Batches and likelihoods that
+  //! return gradients bypass the cache. Asynchronous likelihoods fill it in
+  //! as their evaluations complete. Must outlive the worker.
+  ResultCache* cache = nullptr;
+};
+
+//! A likelihood function paired with a batch version of itself.
+//!
+//! The batch likelihood is called as `nllBatch(type, states, dim, n, out)`.
+//! The states are in struct-of-arrays order, so `states[d * n + i]` is
+//! coordinate d of state i, and `out[i]` receives the likelihood of state i.
+//! All the states in a batch have the same job type. Single jobs are still
+//! evaluated by `nll`.
+//!
+template <class Nll, class NllBatch>
+class BatchNll
+{
+public:
+  BatchNll(Nll nll, NllBatch nllBatch)
+    : nll_(nll)
+    , nllBatch_(nllBatch)
+  {
+  }
+
+  template <class State>
+  auto operator()(JobType type, const State& state) -> decltype(std::declval<Nll&>()(type, state))
+  {
+    return nll_(type, state);
+  }
+
+  void operator()(JobType type, const double* states, std::size_t dim, std::size_t n, double* out)
+  {
+    nllBatch_(type, states, dim, n, out);
+  }
+
+private:
+  Nll nll_;
+  NllBatch nllBatch_;
+};
+
+//! Pair a likelihood function with a batch version of itself. See BatchNll.
+//!
+template <class Nll, class NllBatch>
+BatchNll<Nll, NllBatch> withBatch(Nll nll, NllBatch nllBatch)
+{
+  return {nll, nllBatch};
+}
+
+//! A read-only memory mapping of a whole file.
+//!
+//! The pages are shared with every other thread and process that maps the
+//! same file, so large lookup tables only occupy physical memory once per
+//! node, and are only read from disk the first time they are touched.
+//!
+class MappedFile
+{
+public:
+  //! Map a file into memory.
+  //!
+  //! \param path The path of the file.
+  //! \throws std::system_error if the file cannot be opened or mapped.
+  //!
+  explicit MappedFile(const std::string& path)
+  {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), "Could not open " + path);
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0)
+    {
+      const int error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), "Could not stat " + path);
+    }
+
+    size_ = static_cast<std::size_t>(info.st_size);
+    if (size_ > 0)
+    {
+      data_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (data_ == MAP_FAILED)
+      {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "Could not map " + path);
+      }
+    }
+
+    // The mapping stays valid after the file is closed
+    ::close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  MappedFile(MappedFile&& other)
+    : data_{other.data_}
+    , size_{other.size_}
+  {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  ~MappedFile()
+  {
+    if (data_)
+      ::munmap(data_, size_);
+  }
+
+  const char* data() const { return static_cast<const char*>(data_); }
+  std::size_t size() const { return size_; }
+
+  //! View the file as an array of T. The mapping is page aligned.
+  template <class T>
+  const T* as() const { return static_cast<const T*>(data_); }
+
+private:
+  void* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+//! When the models of a PerJobType likelihood are built.
+enum class ModelInit
+{
+  Lazy,  // Build a model the first time a job of its type arrives
+  Eager  // Build every model up front
+};
+
+//! Thrown by a PerJobType for a job type that it has no model for.
+//!
+//! The worker answers such a job with a NaN result, as it does a malformed
+//! one, since the agent should only send the job types that the worker asked
+//! for.
+//!
+class UnknownJobType : public std::out_of_range
+{
+public:
+  using std::out_of_range::out_of_range;
+};
+
+//! A likelihood function that dispatches each job to a model for its job type.
+//!
+//! The factory is called once per job type as `factory(type)` and returns the
+//! model for that type. A model holds whatever expensive data its type needs
+//! (lookup tables, sensor data, MappedFiles...) and is called as
+//! `model(state)`. A model may also have a batch overload
+//! `model(states, dim, n, out)` (see BatchNll), or return gradients as
+//! `model(state, gradient)`.
+//!
+//! Copies share the same models, and models are built exactly once even when
+//! jobs arrive on several threads at once. As the threads of a worker pool
+//! share the models, a model must be safe to call concurrently through a
+//! const reference.
+//!
+template <class Factory>
+class PerJobType
+{
+public:
+  using Model = typename std::decay<decltype(std::declval<Factory&>()(JobType{}))>::type;
+
+  PerJobType(JobType from, JobType to, Factory factory, ModelInit init = ModelInit::Lazy)
+  {
+    if (to < from)
+      throw std::invalid_argument("Invalid job type range");
+
+    shared_ = std::make_shared<Shared>(from, to, std::move(factory));
+    if (init == ModelInit::Eager)
+    {
+      for (std::size_t i = 0; i < shared_->models.size(); i++)
+        model(static_cast<JobType>(from + i));
+    }
+  }
+
+  template <class State>
+  auto operator()(JobType type, const State& state) -> decltype(std::declval<const Model&>()(state))
+  {
+    return model(type)(state);
+  }
+
+  template <class M = Model>
+  auto operator()(JobType type, const double* states, std::size_t dim, std::size_t n, double* out)
+    -> decltype(std::declval<const M&>()(states, dim, n, out))
+  {
+    return model(type)(states, dim, n, out);
+  }
+
+  template <class M = Model>
+  auto operator()(JobType type, StateView state, double* gradient)
+    -> decltype(std::declval<const M&>()(state, gradient))
+  {
+    return model(type)(state, gradient);
+  }
+
+  //! Get the model of a job type, building it if this is the first use.
+  //!
+  //! \throws UnknownJobType if the job type is outside the registered range.
+  //!
+  const Model& model(JobType type)
+  {
+    Shared& shared = *shared_;
+    if (type < shared.from || type > shared.to)
+      throw UnknownJobType("Job type " + std::to_string(type) + " is not registered");
+
+    const std::size_t i = type - shared.from;
+    std::call_once(shared.built[i], [&shared, i, type]
+    {
+      shared.models[i].reset(new Model(shared.factory(type)));
+    });
+
+    return *shared.models[i];
+  }
+
+  JobType from() const { return shared_->from; }
+  JobType to() const { return shared_->to; }
+
+private:
+  struct Shared
+  {
+    Shared(JobType from, JobType to, Factory factory)
+      : from{from}
+      , to{to}
+      , factory(std::move(factory))
+      , models(std::size_t{to} - from + 1)
+      , built{new std::once_flag[std::size_t{to} - from + 1]}
+    {
+    }
+
+    JobType from;
+    JobType to;
+    Factory factory;
+    std::vector<std::unique_ptr<Model>> models;
+    std::unique_ptr<std::once_flag[]> built;
+  };
+
+  std::shared_ptr<Shared> shared_;
+};
+
+//! Build a likelihood function with one model per job type. See PerJobType.
+//!
+//! \param from The first job type.
+//! \param to The last job type (inclusive).
+//! \param factory Called as factory(type) to build the model of each job type.
+//! \param init Whether to build the models lazily or up front.
+//!
+template <class Factory>
+PerJobType<Factory> perJobType(JobType from, JobType to, Factory factory,
+                               ModelInit init = ModelInit::Lazy)
+{
+  return {from, to, std::move(factory), init};
+}
+
+namespace detail
+{
+
+//! The options to run a likelihood with. A PerJobType sets the range of job
+//! types that the worker asks the agent for to the range it has models for.
+template <class Nll>
+WorkerOptions jobTypeOptions(const Nll&, const WorkerOptions& options)
+{
+  return options;
+}
+
+template <class Factory>
+WorkerOptions jobTypeOptions(const PerJobType<Factory>& nll, const WorkerOptions& options)
+{
+  WorkerOptions result = options;
+  result.jobTypeFrom = nll.from();
+  result.jobTypeTo = nll.to();
+  return result;
+}
+
+}
+
+//! Thrown when a message from the agent is malformed.
+//!
+//! The worker logs such messages rather than stopping. It answers a job whose
+//! IDs can still be read with NaN results, so that the agent is not left
+//! waiting on it, and otherwise reconnects to the agent and starts over.
+//!
+class ProtocolError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+namespace detail
+{
+
+//! How long a closed socket keeps trying to deliver its last messages, in milliseconds.
+constexpr int LINGER_TIME = 1000;
+
+//! How often a worker that can be stopped checks its stop token, in milliseconds.
+constexpr long STOP_POLL_INTERVAL = 100;
+
+// Message types of the Stateline protocol
+constexpr std::uint8_t MSG_HELLO = 1;
+constexpr std::uint8_t MSG_JOB = 2;
+constexpr std::uint8_t MSG_RESULT = 5;
+constexpr std::uint8_t MSG_HEARTBEAT = 8;
+constexpr std::uint8_t MSG_BYE = 9;
+constexpr std::uint8_t MSG_BATCH_JOB = 10;
+constexpr std::uint8_t MSG_BATCH_RESULT = 11;
+constexpr std::uint8_t MSG_GRADIENT_RESULT = 12;
+
+// Capability flags of an extended hello
+constexpr std::uint32_t HELLO_GRADIENT = 1;  // Results carry the gradient of the likelihood
+
+//! Prefix of the address that the evaluator threads of a worker pool use to
+//! reach the broker. Each pool appends a number so pools can share a context.
+constexpr const char* POOL_ADDRESS = "inproc://stateline-worker-pool-";
+
+inline std::string poolAddress()
+{
+  static std::atomic<unsigned int> nextPool{0};
+  return POOL_ADDRESS + std::to_string(nextPool++);
+}
+
+template <class... Args>
+struct PackSize;
+
+template <class T, class... Args>
+struct PackSize<T, Args...>
+{
+  static constexpr std::size_t value = sizeof(T) + PackSize<Args...>::value;
+};
+
+template <>
+struct PackSize<> { static constexpr std::size_t value = 0; };
+
+//! The fixed size header of a message, described by the types of its fields.
+//!
+//! The fields are packed without padding, in order. Their offsets are known at
+//! compile time, and they are read and written with memcpy, so the buffer
+//! needs no particular alignment. Callers check that a buffer holds at least
+//! `size` bytes before reading from it (see checkSize).
+//!
+template <class... Fields>
+struct Schema
+{
+  static constexpr std::size_t size = PackSize<Fields...>::value;
+
+  template <std::size_t I>
+  using Field = typename std::tuple_element<I, std::tuple<Fields...>>::type;
+
+  //! The offset of field i from the start of the message.
+  static constexpr std::size_t offset(std::size_t i)
+  {
+    const std::size_t sizes[] = {0, sizeof(Fields)...};
+
+    std::size_t offset = 0;
+    for (std::size_t j = 1; j <= i; j++)
+      offset += sizes[j];
+
+    return offset;
+  }
+
+  //! The offset of field I, computed at compile time.
+  template <std::size_t I>
+  using Offset = std::integral_constant<std::size_t, offset(I)>;
+
+  template <std::size_t I>
+  static Field<I> get(const char* buf)
+  {
+    Field<I> val;
+    memcpy(&val, buf + Offset<I>::value, sizeof(val));
+    return val;
+  }
+
+  //! Write every field, and return the end of the header.
+  static char* put(char* buf, Fields... fields)
+  {
+    return put(buf, std::index_sequence_for<Fields...>{}, fields...);
+  }
+
+  static std::array<char, size> encode(Fields... fields)
+  {
+    std::array<char, size> buffer;
+    put(buffer.data(), fields...);
+    return buffer;
+  }
+
+private:
+  template <std::size_t... I>
+  static char* put(char* buf, std::index_sequence<I...>, Fields... fields)
+  {
+    using Expand = int[];
+    (void)Expand{0, (memcpy(buf + Offset<I>::value, &fields, sizeof(fields)), 0)...};
+    return buf + size;
+  }
+};
+
+// Message headers of the Stateline protocol. Variable length parts follow the header.
+using HelloSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint32_t,  // Job type from
+  std::uint32_t   // Job type to
+>;
+
+using ExtendedHelloSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint32_t,  // Job type from
+  std::uint32_t,  // Job type to
+  std::uint32_t,  // Number of messages the agent may send ahead
+  std::uint32_t   // Largest number of jobs in a batch
+>;
+
+using CapabilityHelloSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint32_t,  // Job type from
+  std::uint32_t,  // Job type to
+  std::uint32_t,  // Number of messages the agent may send ahead
+  std::uint32_t,  // Largest number of jobs in a batch
+  std::uint32_t   // Capability flags
+>;
+
+using JobSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint32_t,  // Job ID
+  std::uint32_t   // Job type
+>;                // Followed by the state
+
+// The header and the job IDs are padded to multiples of 8 bytes, so that the
+// states stay as aligned as the message and can be read in place
+using BatchJobSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint8_t,   // Padding
+  std::uint16_t,  // Padding
+  std::uint32_t,  // Job type
+  std::uint32_t,  // Number of doubles in each state
+  std::uint32_t   // Number of jobs
+>;                // Followed by the job IDs, padded to a multiple of 8 bytes,
+                  // then the states in struct-of-arrays order
+
+using ResultSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint32_t,  // Job ID
+  double          // Likelihood
+>;
+
+using BatchResultSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint32_t   // Number of jobs
+>;                // Followed by the job IDs, then the likelihoods
+
+using GradientResultSchema = Schema<
+  std::uint8_t,   // Message type
+  std::uint32_t,  // Job ID
+  double          // Likelihood
+>;                // Followed by the gradient
+
+//! Check that a message is large enough to hold a header.
+//!
+//! \throws ProtocolError if it is not.
+//!
+inline void checkSize(std::size_t size, std::size_t expected, const char* what)
+{
+  if (size < expected)
+    throw ProtocolError(std::string{"Truncated "} + what + " message of " +
+                        std::to_string(size) + " bytes");
+}
+
+//! Thrown for a job whose IDs can be read but whose states cannot.
+class MalformedJob : public ProtocolError
+{
+public:
+  MalformedJob(const std::string& what, std::vector<std::uint32_t> ids, bool batch)
+    : ProtocolError{what}
+    , ids{std::move(ids)}
+    , batch{batch}
+  {
+  }
+
+  std::vector<std::uint32_t> ids;
+  bool batch;
+};
+
+template <class T>
+char* packRange(char* buf, const T* vals, std::size_t count)
+{
+  memcpy(buf, vals, count * sizeof(T));
+  return buf + count * sizeof(T);
+}
+
+//! Thin wrapper around a IPC socket to connect to the server and send messages.
+//!
+class IpcSocket
+{
+public:
+  //! Constructs a new IPC socket.
+  //!
+  //! \param ctx The ZMQ context that owns the socket. Sockets sharing a context
+  //!            can talk to each other over the inproc transport.
+  //!
+  IpcSocket(zmq::context_t& ctx)
+    : socket_{ctx, ZMQ_DEALER}
+  {
+    setLinger(LINGER_TIME);
+  }
+
+  IpcSocket(const IpcSocket&) = delete;
+
+  //! Connect to a host.
+  //!
+  //! \param address The address of the host.
+  //!
+  void connect(const std::string& address)
+  {
+    socket_.connect(address);
+  }
+
+  //! Set how long unsent messages are kept after the socket is closed.
+  //!
+  //! \param linger The time in milliseconds. Zero discards them.
+  //!
+  void setLinger(int linger)
+  {
+    socket_.setsockopt(ZMQ_LINGER, linger);
+  }
+
+  //! Send a buffer. connect() must be called prior to calling this method.
+  //!
+  //! The socket is a DEALER so that several requests can be outstanding at
+  //! once, but messages are framed exactly like a REQ socket would frame them.
+  //!
+  //! \params data The bytes to send.
+  //!
+  void send(const char* buf, std::size_t size)
+  {
+    zmq::message_t msg{size};
+    memcpy(msg.data(), buf, size);
+    send(msg);
+  }
+
+  //! Send a message that was built in place, without copying it.
+  void send(zmq::message_t& msg)
+  {
+    // Send the empty delimiter frame that a REQ socket would have sent
+    socket_.send("", 0, ZMQ_SNDMORE);
+
+    // Send the payload message
+    socket_.send(msg);
+  }
+
+  //! Receive a message. The message is returned as is, so its payload can be
+  //! read in place without copying it.
+  //!
+  zmq::message_t recv()
+  {
+    // The payload is the last frame, after the empty delimiter
+    zmq::message_t msg;
+    bool more = true;
+    while (more)
+    {
+      try
+      {
+        socket_.recv(&msg);
+        more = msg.more();
+      }
+      catch (const zmq::error_t& e)
+      {
+        // A signal interrupted the call before anything was received, so try again
+        if (e.num() != EINTR)
+          throw;
+      }
+    }
+
+    return msg;
+  }
+
+  //! Check whether a message is ready to be received.
+  //!
+  //! \param timeout How long to wait for a message in milliseconds.
+  //! \return Whether a message is ready. False if a signal interrupted the wait.
+  //!
+  bool poll(long timeout)
+  {
+    zmq::pollitem_t item{static_cast<void*>(socket_), 0, ZMQ_POLLIN, 0};
+    try
+    {
+      return zmq::poll(&item, 1, timeout) > 0;
+    }
+    catch (const zmq::error_t& e)
+    {
+      if (e.num() != EINTR)
+        throw;
+
+      return false;
+    }
+  }
+
+  //! Wait for a message, or for a file descriptor to become readable.
+  //!
+  //! \param timeout How long to wait in milliseconds.
+  //! \param fd The file descriptor to watch.
+  //! \param fdReady Set to whether the file descriptor is readable.
+  //! \return Whether a message is ready. False if a signal interrupted the wait.
+  //!
+  bool poll(long timeout, int fd, bool& fdReady)
+  {
+    zmq::pollitem_t items[] = {
+      {static_cast<void*>(socket_), 0, ZMQ_POLLIN, 0},
+      {nullptr, fd, ZMQ_POLLIN, 0}
+    };
+
+    fdReady = false;
+    try
+    {
+      zmq::poll(items, 2, timeout);
+    }
+    catch (const zmq::error_t& e)
+    {
+      if (e.num() != EINTR)
+        throw;
+
+      return false;
+    }
+
+    fdReady = items[1].revents & ZMQ_POLLIN;
+    return items[0].revents & ZMQ_POLLIN;
+  }
+
+private:
+  zmq::socket_t socket_;
+};
+
+//! A job, or a batch of jobs of the same type, received from the agent. The
+//! job IDs and data are left in the message they arrived in.
+//!
+//! Small messages keep their data inside the message object, so the job
+//! refers to its IDs and data by offset to stay valid when it is moved.
+//!
+struct Job
+{
+  JobType type;
+  zmq::message_t msg;
+  bool batch;             // Whether the message was a batch
+  std::size_t count;      // Number of jobs in the message
+  std::size_t idsOffset;  // Offset of the job IDs inside msg
+  std::size_t dataOffset; // Offset of the job data inside msg
+  std::size_t length;     // Number of doubles in each state
+
+  const char* ids() const { return static_cast<const char*>(msg.data()) + idsOffset; }
+  const char* data() const { return static_cast<const char*>(msg.data()) + dataOffset; }
+
+  JobID id(std::size_t i = 0) const
+  {
+    std::uint32_t id;
+    memcpy(&id, ids() + i * sizeof(id), sizeof(id));
+    return id;
+  }
+};
+
+//! Provides a layer above a socket that can understand the Stateline protocol.
+//!
+template <class Socket>
+class MessageHandler
+{
+public:
+
+  //! \param socket The socket to talk to the agent over.
+  //! \param acceptBatches Whether batch jobs are accepted. If not, they are
+  //!                      rejected as malformed.
+  //!
+  MessageHandler(Socket& socket, bool acceptBatches = true)
+    : socket_(socket)
+    , acceptBatches_{acceptBatches}
+  {
+  }
+
+  void sendHello(JobType from, JobType to, unsigned int prefetch = 1, unsigned int maxBatch = 1,
+                 bool gradient = false)
+  {
+    if (gradient)
+    {
+      auto buf = CapabilityHelloSchema::encode(MSG_HELLO, from, to, prefetch, maxBatch, HELLO_GRADIENT);
+      socket_.send(buf.data(), buf.size());
+    }
+    else if (prefetch <= 1 && maxBatch <= 1)
+    {
+      auto buf = HelloSchema::encode(MSG_HELLO, from, to);
+      socket_.send(buf.data(), buf.size());
+    }
+    else
+    {
+      auto buf = ExtendedHelloSchema::encode(MSG_HELLO, from, to, prefetch, maxBatch);
+      socket_.send(buf.data(), buf.size());
+    }
+  }
+
+  //! Receive the next message from the agent.
+  //!
+  //! \param job Set to the received job.
+  //! \param bytes Set to the size of the message, even if it is malformed.
+  //! \return Whether the message was a job. Heartbeats are not jobs.
+  //! \throws MalformedJob if the message is a job that is malformed but whose
+  //!        IDs can be read.
+  //! \throws ProtocolError if the message is malformed otherwise.
+  //!
+  bool recvJob(Job& job, std::size_t& bytes)
+  {
+    auto msg = socket_.recv();
+    const auto buf = static_cast<const char*>(msg.data());
+    const auto size = msg.size();
+    bytes = size;
+
+    if (size == 0)
+      throw ProtocolError("Empty message");
+
+    const std::uint8_t type = buf[0];
+    switch (type)
+    {
+      case MSG_HEARTBEAT:
+        return false;
+
+      case MSG_JOB:
+      {
+        checkSize(size, JobSchema::size, "job");
+
+        // The remaining bytes in the buffer is the job data
+        const std::size_t numBytesLeft = size - JobSchema::size;
+        if (numBytesLeft % sizeof(double) != 0)
+          throw MalformedJob("Job data of " + std::to_string(numBytesLeft) +
+                             " bytes is not a whole number of doubles",
+                             {JobSchema::get<1>(buf)}, false);
+
+        job = Job{
+          JobSchema::get<2>(buf),
+          std::move(msg),
+          false,
+          1,
+          JobSchema::offset(1),
+          JobSchema::size,
+          numBytesLeft / sizeof(double)
+        };
+        return true;
+      }
+
+      case MSG_BATCH_JOB:
+      {
+        checkSize(size, BatchJobSchema::size, "batch");
+
+        // The job IDs are followed by the states in struct-of-arrays order. The
+        // sizes are at most 32 bits each, so their products cannot overflow.
+        const std::uint64_t length = BatchJobSchema::get<4>(buf);
+        const std::uint64_t count = BatchJobSchema::get<5>(buf);
+        const std::uint64_t idsSize = count * sizeof(std::uint32_t);
+        const std::uint64_t paddedIdsSize = (idsSize + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+        const std::uint64_t dataSize = size - BatchJobSchema::size;
+        if (dataSize < idsSize)
+          throw ProtocolError("Batch of " + std::to_string(count) + " jobs is too short for its IDs");
+
+        const bool matches = dataSize >= paddedIdsSize &&
+                             (dataSize - paddedIdsSize) / sizeof(double) == count * length &&
+                             (dataSize - paddedIdsSize) % sizeof(double) == 0;
+        if (!matches || !acceptBatches_)
+        {
+          std::vector<std::uint32_t> ids(count);
+          memcpy(ids.data(), buf + BatchJobSchema::size, idsSize);
+          throw MalformedJob(!acceptBatches_ ? "Batch of " + std::to_string(count) + " jobs was not asked for" :
+                             "Batch of " + std::to_string(count) + " jobs of " +
+                             std::to_string(length) + " doubles does not match its size of " +
+                             std::to_string(size) + " bytes", std::move(ids), true);
+        }
+
+        job = Job{
+          BatchJobSchema::get<3>(buf),
+          std::move(msg),
+          true,
+          count,
+          BatchJobSchema::size,
+          BatchJobSchema::size + paddedIdsSize,
+          length
+        };
+        return true;
+      }
+
+      default:
+        throw ProtocolError("Unknown message type " + std::to_string(type));
+    }
+  }
+
+  void sendHeartbeat()
+  {
+    socket_.send(reinterpret_cast<const char*>(&MSG_HEARTBEAT), sizeof(MSG_HEARTBEAT));
+  }
+
+  //! Tell the agent that the worker is leaving and will not take more jobs.
+  void sendBye()
+  {
+    socket_.send(reinterpret_cast<const char*>(&MSG_BYE), sizeof(MSG_BYE));
+  }
+
+  std::size_t sendResult(std::uint32_t id, double data)
+  {
+    auto buf = ResultSchema::encode(MSG_RESULT, id, data);
+    socket_.send(buf.data(), buf.size());
+    return buf.size();
+  }
+
+  //! Send the results of a batch.
+  //!
+  //! \param ids The job IDs, exactly as they arrived in the batch.
+  //! \param count The number of jobs in the batch.
+  //! \param results The likelihood of each job.
+  //! \return The number of bytes sent.
+  //!
+  std::size_t sendBatchResult(const char* ids, std::size_t count, const double* results)
+  {
+    const std::size_t size = BatchResultSchema::size + count * (sizeof(std::uint32_t) + sizeof(double));
+    zmq::message_t msg{size};
+
+    auto buf = BatchResultSchema::put(static_cast<char*>(msg.data()), MSG_BATCH_RESULT, count);
+    buf = packRange(buf, ids, count * sizeof(std::uint32_t));
+    packRange(buf, results, count);
+
+    socket_.send(msg);
+    return size;
+  }
+
+  //! Send the result of a job together with the gradient of its likelihood.
+  //!
+  //! \param id The job ID.
+  //! \param nll The likelihood of the job.
+  //! \param gradient The gradient of the likelihood with respect to the state.
+  //! \param length The number of elements in the gradient.
+  //! \return The number of bytes sent.
+  //!
+  std::size_t sendGradientResult(std::uint32_t id, double nll, const double* gradient,
+                                 std::size_t length)
+  {
+    const std::size_t size = GradientResultSchema::size + length * sizeof(double);
+    zmq::message_t msg{size};
+
+    auto buf = GradientResultSchema::put(static_cast<char*>(msg.data()), MSG_GRADIENT_RESULT, id, nll);
+    packRange(buf, gradient, length);
+
+    socket_.send(msg);
+    return size;
+  }
+
+private:
+  Socket& socket_;
+  bool acceptBatches_;
+};
+
+template <class...>
+struct Void { using type = void; };
+
+//! Whether a likelihood function can be called with a StateView.
+template <class Nll, class = void>
+struct AcceptsStateView : std::false_type {};
+
+template <class Nll>
+struct AcceptsStateView<Nll, typename Void<
+  decltype(std::declval<Nll&>()(std::declval<JobType>(), std::declval<StateView>()))
+>::type> : std::true_type {};
+
+//! Whether a likelihood function has a batch overload.
+template <class Nll, class = void>
+struct AcceptsBatch : std::false_type {};
+
+template <class Nll>
+struct AcceptsBatch<Nll, typename Void<
+  decltype(std::declval<Nll&>()(std::declval<JobType>(), std::declval<const double*>(),
+                                std::declval<std::size_t>(), std::declval<std::size_t>(),
+                                std::declval<double*>()))
+>::type> : std::true_type {};
+
+//! Whether a likelihood function can return its gradient.
+template <class Nll, class = void>
+struct AcceptsGradient : std::false_type {};
+
+template <class Nll>
+struct AcceptsGradient<Nll, typename Void<
+  decltype(std::declval<Nll&>()(std::declval<JobType>(), std::declval<StateView>(),
+                                std::declval<double*>()))
+>::type> : std::true_type {};
+
+//! Whether a likelihood function is asynchronous.
+template <class Nll, class = void>
+struct AcceptsCompletion : std::false_type {};
+
+template <class Nll>
+struct AcceptsCompletion<Nll, typename Void<
+  decltype(std::declval<Nll&>()(std::declval<JobType>(), std::declval<StateView>(),
+                                std::declval<Completion>()))
+>::type> : std::true_type {};
+
+//! Whether a likelihood function can be called on a StateView, with or without a gradient.
+template <class Nll>
+using AcceptsAnyView = std::integral_constant<bool,
+  AcceptsStateView<Nll>::value || AcceptsGradient<Nll>::value>;
+
+inline bool isAligned(const char* data)
+{
+  return reinterpret_cast<std::uintptr_t>(data) % alignof(double) == 0;
+}
+
+//! Calls a likelihood function on job data that is still inside its message.
+//!
+//! Likelihoods taking a StateView read the data in place when it is suitably
+//! aligned. Otherwise, the data is copied once into a buffer that is reused
+//! from job to job, so that no memory is allocated once the buffer has grown
+//! to the size of the state.
+//!
+//! Likelihoods that return gradients are given a scratch gradient when only
+//! the likelihood is wanted.
+//!
+template <class Nll>
+class Evaluator
+{
+public:
+  Evaluator(Nll& nll)
+    : nll_(nll)
+  {
+  }
+
+  double operator()(JobType type, const char* data, std::size_t length)
+  {
+    return evaluate(type, data, length, AcceptsAnyView<Nll>{});
+  }
+
+  //! Evaluate a job and the gradient of its likelihood.
+  //!
+  //! \param gradient Receives the gradient. Must have room for length doubles.
+  //!
+  double operator()(JobType type, const char* data, std::size_t length, double* gradient)
+  {
+    if (isAligned(data))
+      return nll_(type, StateView{reinterpret_cast<const double*>(data), length}, gradient);
+
+    buffer_.resize(length);
+    memcpy(buffer_.data(), data, length * sizeof(double));
+    return nll_(type, StateView{buffer_.data(), buffer_.size()}, gradient);
+  }
+
+  //! Evaluate a batch of states stored in struct-of-arrays order.
+  void operator()(JobType type, const char* data, std::size_t length, std::size_t count,
+                  double* results)
+  {
+    evaluateBatch(type, data, length, count, results, AcceptsBatch<Nll>{});
+  }
+
+private:
+  double evaluate(JobType type, const char* data, std::size_t length, std::true_type)
+  {
+    if (isAligned(data))
+      return evaluateView(type, StateView{reinterpret_cast<const double*>(data), length},
+                          AcceptsStateView<Nll>{});
+
+    buffer_.resize(length);
+    memcpy(buffer_.data(), data, length * sizeof(double));
+    return evaluateBuffer(type, std::true_type{});
+  }
+
+  double evaluate(JobType type, const char* data, std::size_t length, std::false_type)
+  {
+    buffer_.resize(length);
+    memcpy(buffer_.data(), data, length * sizeof(double));
+    return evaluateBuffer(type, std::false_type{});
+  }
+
+  double evaluateBuffer(JobType type, std::true_type)
+  {
+    return evaluateView(type, StateView{buffer_.data(), buffer_.size()}, AcceptsStateView<Nll>{});
+  }
+
+  double evaluateView(JobType type, StateView state, std::true_type)
+  {
+    return nll_(type, state);
+  }
+
+  double evaluateView(JobType type, StateView state, std::false_type)
+  {
+    gradient_.resize(state.size());
+    return nll_(type, state, gradient_.data());
+  }
+
+  double evaluateBuffer(JobType type, std::false_type)
+  {
+    return nll_(type, static_cast<const std::vector<double>&>(buffer_));
+  }
+
+  void evaluateBatch(JobType type, const char* data, std::size_t length, std::size_t count,
+                     double* results, std::true_type)
+  {
+    if (isAligned(data))
+    {
+      nll_(type, reinterpret_cast<const double*>(data), length, count, results);
+      return;
+    }
+
+    buffer_.resize(length * count);
+    memcpy(buffer_.data(), data, length * count * sizeof(double));
+    nll_(type, static_cast<const double*>(buffer_.data()), length, count, results);
+  }
+
+  void evaluateBatch(JobType type, const char* data, std::size_t length, std::size_t count,
+                     double* results, std::false_type)
+  {
+    // Fall back to evaluating one job at a time, gathering each state out of the batch
+    buffer_.resize(length);
+    for (std::size_t i = 0; i < count; i++)
+    {
+      for (std::size_t d = 0; d < length; d++)
+        memcpy(&buffer_[d], data + (d * count + i) * sizeof(double), sizeof(double));
+
+      results[i] = evaluateBuffer(type, AcceptsAnyView<Nll>{});
+    }
+  }
+
+  Nll& nll_;
+  std::vector<double> buffer_;
+  std::vector<double> gradient_;
+};
+
+//! Adjust the number of jobs held by the worker and track the high water mark.
+inline void addInFlight(PipelineStats& stats, int delta)
+{
+  const unsigned int inFlight = stats.inFlight.fetch_add(delta) + delta;
+
+  unsigned int maxInFlight = stats.maxInFlight.load();
+  while (inFlight > maxInFlight && !stats.maxInFlight.compare_exchange_weak(maxInFlight, inFlight))
+    ;
+}
+
+//! Pins the calling thread to a CPU, and restores the thread's previous
+//! affinity when destroyed.
+//!
+//! Does nothing on platforms without thread affinity.
+//!
+class ThreadPin
+{
+public:
+  //! Pin the calling thread to cpus[index % cpus.size()], or leave it be if
+  //! cpus is empty.
+  //!
+  //! \throws std::system_error if the thread cannot be pinned to the CPU.
+  //!
+  ThreadPin(const std::vector<int>& cpus, std::size_t index)
+  {
+#ifdef __linux__
+    if (cpus.empty())
+      return;
+
+    const int cpu = cpus[index % cpus.size()];
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+      throw std::system_error(EINVAL, std::generic_category(), "Invalid CPU " + std::to_string(cpu));
+
+    int error = pthread_getaffinity_np(pthread_self(), sizeof(previous_), &previous_);
+    if (error == 0)
+    {
+      cpu_set_t pinned;
+      CPU_ZERO(&pinned);
+      CPU_SET(cpu, &pinned);
+      error = pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+    }
+
+    if (error != 0)
+      throw std::system_error(error, std::generic_category(), "Could not pin thread to CPU " + std::to_string(cpu));
+
+    pinned_ = true;
+#else
+    (void)cpus;
+    (void)index;
+#endif
+  }
+
+  ThreadPin(const ThreadPin&) = delete;
+
+  ~ThreadPin()
+  {
+#ifdef __linux__
+    if (pinned_)
+      pthread_setaffinity_np(pthread_self(), sizeof(previous_), &previous_);
+#endif
+  }
+
+private:
+#ifdef __linux__
+  cpu_set_t previous_;
+  bool pinned_ = false;
+#endif
+};
+
+//! Check that the worker options are consistent.
+//!
+//! \throws std::invalid_argument if they are not.
+//!
+inline void checkOptions(const WorkerOptions& options)
+{
+  // Without heartbeats, or with heartbeats that are too rare, a healthy agent
+  // has nothing to say before the timeout and the worker reconnects needlessly
+  if (options.reconnectTimeout.count() > 0 &&
+      (options.heartbeatInterval.count() <= 0 || options.heartbeatInterval >= options.reconnectTimeout))
+    throw std::invalid_argument("A reconnect timeout needs a shorter heartbeat interval");
+
+#ifdef __linux__
+  // Catch a bad CPU before any thread has connected to the agent
+  cpu_set_t allowed;
+  const bool known = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+  for (int cpu : options.evaluatorCpus)
+  {
+    if (cpu < 0 || cpu >= CPU_SETSIZE || (known && !CPU_ISSET(cpu, &allowed)))
+      throw std::invalid_argument("Cannot pin an evaluator thread to CPU " + std::to_string(cpu));
+  }
+#endif
+}
+
+//! The context given in the worker options, or a new context owned by the worker.
+//!
+class WorkerContext
+{
+public:
+  explicit WorkerContext(const WorkerOptions& options)
+    : owned_{options.context ? nullptr : create(options)}
+    , ctx_(options.context ? *options.context : *owned_)
+  {
+  }
+
+  zmq::context_t& get() { return ctx_; }
+
+private:
+  static zmq::context_t* create(const WorkerOptions& options)
+  {
+    std::unique_ptr<zmq::context_t> ctx{new zmq::context_t{options.numIOThreads}};
+
+    // The IO threads start with the first socket, so they are pinned before then
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    for (int cpu : options.ioCpus)
+    {
+      if (zmq_ctx_set(static_cast<void*>(*ctx), ZMQ_THREAD_AFFINITY_CPU_ADD, cpu) != 0)
+        throw zmq::error_t();
+    }
+#else
+    if (!options.ioCpus.empty())
+      std::cerr << "This version of ZMQ cannot pin its IO threads" << std::endl;
+#endif
+
+    return ctx.release();
+  }
+
+  std::unique_ptr<zmq::context_t> owned_;
+  zmq::context_t& ctx_;
+};
+
+//! Whether an error means that the context was terminated.
+inline bool isTerminated(const zmq::error_t& e)
+{
+  return e.num() == ETERM;
+}
+
+//! Reports the metrics requested by the worker options from a background thread.
+//!
+class MetricsReporter
+{
+public:
+  //! Start reporting, if the options ask for periodic reports. The worker
+  //! creates its own metrics when the options do not provide any.
+  explicit MetricsReporter(const WorkerOptions& options)
+    : options_(options)
+  {
+    if (options_.metricsInterval.count() <= 0)
+      return;
+
+    if (!options_.metrics)
+    {
+      metrics_.reset(new WorkerMetrics{options_.jobTypeFrom, options_.jobTypeTo});
+      options_.metrics = metrics_.get();
+    }
+
+    std::function<void(const MetricsSnapshot&)> report = options_.onMetrics;
+    if (!report)
+      report = JsonMetricsWriter{std::cerr};
+
+    thread_ = std::thread{[this, report]
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      while (!stopped_.wait_for(lock, options_.metricsInterval, [this] { return stop_; }))
+        report(options_.metrics->snapshot());
+    }};
+  }
+
+  MetricsReporter(const MetricsReporter&) = delete;
+
+  ~MetricsReporter()
+  {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      stop_ = true;
+    }
+
+    stopped_.notify_all();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  //! The worker options, pointing at the metrics being reported.
+  const WorkerOptions& options() const { return options_; }
+
+private:
+  WorkerOptions options_;
+  std::unique_ptr<WorkerMetrics> metrics_;
+  std::mutex mutex_;
+  std::condition_variable stopped_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+//! Evaluates the jobs that an agent sends over one connection.
+//!
+//! Runs until the stop token in the options is set, or until the process is
+//! killed. While it waits for a job, it keeps the connection alive with
+//! heartbeats, and reconnects if the agent stays silent for too long.
+//!
+//! Asynchronous likelihoods (see Completion) are started on up to
+//! options.concurrency jobs at once, and each result is sent as soon as its
+//! evaluation completes.
+//!
+template <class Nll>
+class JobLoop
+{
+public:
+  //! Connect to an agent (or a broker) and say hello.
+  //!
+  //! \param ctx The ZMQ context to create sockets in.
+  //! \param address The address of the agent.
+  //! \param nll The likelihood function used to evaluate each job.
+  //! \param options The worker options. Must outlive the loop.
+  //!
+  JobLoop(zmq::context_t& ctx, std::string address, Nll& nll, const WorkerOptions& options)
+    : ctx_(ctx)
+    , address_{std::move(address)}
+    , nll_(nll)
+    , evaluate_{nll}
+    , options_(options)
+    , shard_{options.metrics ? &options.metrics->addShard() : nullptr}
+    , concurrency_{ASYNC ? std::max(1u, options.concurrency) : 1u}
+    , window_{std::max({1u, options.prefetch, concurrency_})}
+    , maxBatch_{AcceptsGradient<Nll>::value || ASYNC ? 1u : std::max(1u, options.maxBatch)}
+    , timed_{options.stop || options.heartbeatInterval.count() > 0 || options.reconnectTimeout.count() > 0}
+  {
+    if (ASYNC)
+    {
+      completions_ = std::make_shared<CompletionQueue>();
+      pending_.resize(concurrency_);
+      for (std::size_t i = concurrency_; i > 0; i--)
+        free_.push_back(i - 1);
+    }
+
+    connect();
+  }
+
+  //! Waits for the evaluations that are still running, as they refer to their jobs.
+  ~JobLoop()
+  {
+    while (numPending_ > 0)
+    {
+      completions_->wait();
+      completions_->take(completed_);
+      numPending_ -= completed_.size();
+    }
+  }
+
+  //! Evaluate jobs until a stop is requested.
+  //!
+  //! The jobs that have already been received when the stop is requested are
+  //! evaluated and their results sent before the worker says goodbye.
+  //!
+  void run()
+  {
+    while (!stopRequested())
+    {
+      // Queue up the jobs that the agent has already sent ahead
+      if (window_ > 1)
+        drain();
+
+      if (ASYNC)
+        finishCompleted();
+
+      if (!jobs_.empty() && numPending_ < concurrency_)
+      {
+        start(std::integral_constant<bool, ASYNC>{});
+        continue;
+      }
+
+      // Waiting on evaluations that are still running is not a stall
+      if (jobs_.empty() && numPending_ == 0 && options_.stats) options_.stats->stalls++;
+
+      waitForJob();
+    }
+
+    drain();
+    while (!jobs_.empty() || numPending_ > 0)
+    {
+      if (!jobs_.empty() && numPending_ < concurrency_)
+      {
+        start(std::integral_constant<bool, ASYNC>{});
+      }
+      else
+      {
+        completions_->wait();
+        finishCompleted();
+      }
+    }
+
+    handler_->sendBye();
+  }
+
+private:
+  static constexpr bool ASYNC = AcceptsCompletion<Nll>::value;
+
+  bool stopRequested() const
+  {
+    return options_.stop && options_.stop->stopRequested();
+  }
+
+  void connect()
+  {
+    handler_.reset();
+    socket_.reset(new IpcSocket{ctx_});
+    socket_->connect(address_);
+    // An asynchronous evaluation takes a single state, so it cannot take batches
+    handler_.reset(new MessageHandler<IpcSocket>{*socket_, !ASYNC});
+
+    // Send hello message to initiate the protocol
+    handler_->sendHello(options_.jobTypeFrom, options_.jobTypeTo, window_, maxBatch_,
+                        AcceptsGradient<Nll>::value);
+    lastSent_ = lastHeard_ = Clock::now();
+  }
+
+  //! Start over with a new connection, as if the worker had just started.
+  //!
+  //! The agent hands out the jobs of the old connection again, so the queued
+  //! jobs are dropped, and the results of running evaluations are not sent.
+  //!
+  void reconnect()
+  {
+    // Anything still unsent was meant for an agent that has gone away
+    socket_->setLinger(0);
+    connect();
+
+    if (options_.stats) addInFlight(*options_.stats, -static_cast<int>(jobs_.size()));
+    jobs_.clear();
+
+    for (auto& pending : pending_)
+      pending.stale = true;
+  }
+
+  //! Answer a job that could not be read with NaN results, which also returns
+  //! its credit to the agent.
+  void reject(const MalformedJob& e)
+  {
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    std::size_t bytesOut;
+    if (e.batch)
+    {
+      results_.assign(e.ids.size(), nan);
+      bytesOut = handler_->sendBatchResult(reinterpret_cast<const char*>(e.ids.data()),
+                                           e.ids.size(), results_.data());
+    }
+    else if (AcceptsGradient<Nll>::value)
+    {
+      bytesOut = handler_->sendGradientResult(e.ids.front(), nan, &nan, 0);
+    }
+    else
+    {
+      bytesOut = handler_->sendResult(e.ids.front(), nan);
+    }
+
+    if (timed_) lastSent_ = Clock::now();
+    if (shard_) add(shard_->bytesOut, bytesOut);
+  }
+
+  //! Receive a message, queueing it if it is a job.
+  //!
+  //! \param start When the worker started waiting for the message.
+  //! \param idle Whether the worker had nothing else to do while it waited.
+  //! \return Whether the message was a job.
+  //!
+  bool receive(Clock::time_point start, bool idle)
+  {
+    Job job;
+    std::size_t bytes = 0;
+    bool isJob = false;
+    try
+    {
+      isJob = handler_->recvJob(job, bytes);
+    }
+    catch (const MalformedJob& e)
+    {
+      std::cerr << "Rejected a job from " << address_ << ": " << e.what() << std::endl;
+      reject(e);
+    }
+    catch (const ProtocolError& e)
+    {
+      // Without the job IDs there is no way to answer the agent
+      std::cerr << "Dropped a message from " << address_ << ": " << e.what() << ", reconnecting" << std::endl;
+      reconnect();
+    }
+    if (timed_) lastHeard_ = Clock::now();
+
+    if (shard_)
+    {
+      const auto ns = nanosecondsSince(start);
+      add(shard_->bytesIn, bytes);
+      if (idle) add(shard_->idleNs, ns);
+      if (isJob)
+      {
+        if (auto type = shard_->find(job.type)) type->recv.record(ns);
+      }
+    }
+
+    if (!isJob)
+      return false;
+
+    jobs_.push_back(std::move(job));
+    if (options_.stats) addInFlight(*options_.stats, 1);
+    return true;
+  }
+
+  //! Queue the messages that have already arrived, without waiting.
+  void drain()
+  {
+    while (socket_->poll(0))
+      receive(shard_ ? Clock::now() : Clock::time_point{}, false);
+  }
+
+  //! Wait for the agent to send a job, for an asynchronous evaluation to
+  //! complete, or for a stop to be requested.
+  void waitForJob()
+  {
+    const auto start = Clock::now();
+    const bool idle = numPending_ == 0;
+
+    if (!timed_ && !ASYNC)
+    {
+      while (!receive(start, true))
+        ;
+
+      return;
+    }
+
+    // The agent has nothing to say while the worker is busy, so only count silence from here
+    lastHeard_ = start;
+
+    const auto heartbeat = options_.heartbeatInterval;
+    const auto timeout = options_.reconnectTimeout;
+    while (!stopRequested())
+    {
+      auto now = Clock::now();
+      if (heartbeat.count() > 0 && now - lastSent_ >= heartbeat)
+      {
+        handler_->sendHeartbeat();
+        lastSent_ = now;
+      }
+
+      // While evaluations are running, the agent is waiting on the worker
+      if (timeout.count() > 0 && numPending_ == 0 && now - lastHeard_ >= timeout)
+      {
+        std::cerr << "No reply from " << address_ << ", reconnecting" << std::endl;
+        reconnect();
+        return;
+      }
+
+      // Wake up in time for the next stop check, heartbeat or reconnect, whichever is first
+      long wait = options_.stop ? STOP_POLL_INTERVAL : -1;
+      auto until = [&](Clock::time_point deadline)
+      {
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+        wait = wait < 0 ? ms : std::min<long>(wait, ms);
+      };
+
+      if (heartbeat.count() > 0) until(lastSent_ + heartbeat);
+      if (timeout.count() > 0) until(lastHeard_ + timeout);
+
+      if (ASYNC)
+      {
+        bool completed;
+        const bool ready = socket_->poll(wait < 0 ? -1 : std::max(0L, wait), completions_->fd(), completed);
+        if ((ready && receive(start, idle)) || completed)
+          return;
+      }
+      else if (socket_->poll(std::max(0L, wait)) && receive(start, true))
+      {
+        return;
+      }
+    }
+  }
+
+  //! Evaluate the job at the front of the queue and send its result.
+  void start(std::false_type)
+  {
+    process();
+  }
+
+  //! Start an asynchronous evaluation of the job at the front of the queue.
+  void start(std::true_type)
+  {
+    auto job = std::move(jobs_.front());
+    jobs_.pop_front();
+
+    double result;
+    if (options_.cache && options_.cache->find(job.type, job.data(), job.length, result))
+    {
+      const auto bytesOut = handler_->sendResult(job.id(), result);
+      finish(job, shard_ ? Clock::now() : Clock::time_point{}, bytesOut);
+      return;
+    }
+
+    const std::size_t slot = free_.back();
+    free_.pop_back();
+
+    Pending& pending = pending_[slot];
+    pending.job = std::move(job);
+    pending.start = shard_ ? Clock::now() : Clock::time_point{};
+    pending.stale = false;
+
+    // The state must stay put until the evaluation completes, so it is only copied if misaligned
+    const Job& queued = pending.job;
+    StateView state{reinterpret_cast<const double*>(queued.data()), queued.length};
+    if (!isAligned(queued.data()))
+    {
+      pending.buffer.resize(queued.length);
+      memcpy(pending.buffer.data(), queued.data(), queued.length * sizeof(double));
+      state = StateView{pending.buffer.data(), pending.buffer.size()};
+    }
+
+    // A completion that arrives before this returns is only taken after the count goes up
+    nll_(queued.type, state, Completion{completions_, slot});
+    numPending_++;
+  }
+
+  //! Send the results of the asynchronous evaluations that have completed.
+  void finishCompleted()
+  {
+    completions_->take(completed_);
+    for (const auto& completed : completed_)
+    {
+      Pending& pending = pending_[completed.first];
+      const Job& job = pending.job;
+      const auto evaluated = shard_ ? Clock::now() : Clock::time_point{};
+
+      if (options_.cache) options_.cache->insert(job.type, job.data(), job.length, completed.second);
+      if (!pending.stale)
+      {
+        const auto bytesOut = handler_->sendResult(job.id(), completed.second);
+        finish(job, pending.start, bytesOut, evaluated);
+      }
+      else if (options_.stats)
+      {
+        addInFlight(*options_.stats, -1);
+      }
+
+      // Free the message now rather than when the slot is next used
+      pending.job = Job{};
+      free_.push_back(completed.first);
+      numPending_--;
+    }
+  }
+
+  //! Evaluate the job at the front of the queue and send its result.
+  void process()
+  {
+    const auto job = std::move(jobs_.front());
+    jobs_.pop_front();
+
+    const auto start = shard_ ? Clock::now() : Clock::time_point{};
+    auto evaluated = start;
+    std::size_t bytesOut;
+
+    // The result also returns the job's credit to the agent
+    try
+    {
+      if (job.batch)
+      {
+        results_.resize(job.count);
+        evaluate_(job.type, job.data(), job.length, job.count, results_.data());
+        if (shard_) evaluated = Clock::now();
+
+        bytesOut = handler_->sendBatchResult(job.ids(), job.count, results_.data());
+      }
+      else
+      {
+        bytesOut = processJob(job, evaluated, AcceptsGradient<Nll>{});
+      }
+    }
+    catch (const UnknownJobType& e)
+    {
+      std::cerr << "Rejected a job from " << address_ << ": " << e.what() << std::endl;
+
+      std::vector<std::uint32_t> ids(job.count);
+      for (std::size_t i = 0; i < job.count; i++)
+        ids[i] = job.id(i);
+
+      reject(MalformedJob{e.what(), std::move(ids), job.batch});
+      if (options_.stats) addInFlight(*options_.stats, -1);
+      return;
+    }
+
+    finish(job, start, bytesOut, evaluated);
+  }
+
+  //! Record that the result of a job has been sent.
+  //!
+  //! \param start When the evaluation started, if metrics are enabled.
+  //! \param bytesOut The size of the result.
+  //! \param evaluated When the evaluation finished, if metrics are enabled.
+  //!
+  void finish(const Job& job, Clock::time_point start, std::size_t bytesOut,
+              Clock::time_point evaluated)
+  {
+    // A result tells the agent that the worker is alive just as well as a heartbeat
+    if (timed_) lastSent_ = Clock::now();
+
+    if (PipelineStats* stats = options_.stats)
+    {
+      stats->jobs += job.count;
+      addInFlight(*stats, -1);
+    }
+
+    if (shard_)
+    {
+      add(shard_->jobs, job.count);
+      add(shard_->bytesOut, bytesOut);
+      if (auto type = shard_->find(job.type))
+      {
+        add(type->jobs, job.count);
+        type->nll.record(nanosecondsSince(start, evaluated));
+        type->send.record(nanosecondsSince(evaluated));
+      }
+    }
+  }
+
+  void finish(const Job& job, Clock::time_point start, std::size_t bytesOut)
+  {
+    finish(job, start, bytesOut, start);
+  }
+
+  //! Evaluate a single job and send its result.
+  //!
+  //! \param evaluated Set to when the evaluation finished, if metrics are enabled.
+  //! \return The number of bytes sent.
+  //!
+  std::size_t processJob(const Job& job, Clock::time_point& evaluated, std::false_type)
+  {
+    ResultCache* cache = options_.cache;
+
+    double result;
+    if (!cache || !cache->find(job.type, job.data(), job.length, result))
+    {
+      result = evaluate_(job.type, job.data(), job.length);
+      if (cache) cache->insert(job.type, job.data(), job.length, result);
+    }
+    if (shard_) evaluated = Clock::now();
+
+    return handler_->sendResult(job.id(), result);
+  }
+
+  std::size_t processJob(const Job& job, Clock::time_point& evaluated, std::true_type)
+  {
+    results_.resize(job.length);
+    const double result = evaluate_(job.type, job.data(), job.length, results_.data());
+    if (shard_) evaluated = Clock::now();
+
+    return handler_->sendGradientResult(job.id(), result, results_.data(), job.length);
+  }
+
+  //! An asynchronous evaluation that has not completed yet.
+  struct Pending
+  {
+    Job job;
+    Clock::time_point start;
+    std::vector<double> buffer; // An aligned copy of the state, if the message data is not aligned
+    bool stale = false;         // Started before the worker reconnected, so its result is not sent
+  };
+
+  zmq::context_t& ctx_;
+  std::string address_;
+  Nll& nll_;
+  Evaluator<Nll> evaluate_;
+  const WorkerOptions& options_;
+  MetricsShard* shard_;
+  unsigned int concurrency_;
+  unsigned int window_;
+  unsigned int maxBatch_;
+  bool timed_;
+
+  std::unique_ptr<IpcSocket> socket_;
+  std::unique_ptr<MessageHandler<IpcSocket>> handler_;
+
+  std::deque<Job> jobs_;
+  std::vector<double> results_; // The results of a batch, or the gradient of a job
+
+  std::shared_ptr<CompletionQueue> completions_;
+  std::vector<Pending> pending_;     // Indexed by slot
+  std::vector<std::size_t> free_;    // Slots that have no evaluation running
+  std::vector<std::pair<std::size_t, double>> completed_;
+  std::size_t numPending_ = 0;
+  Clock::time_point lastSent_;
+  Clock::time_point lastHeard_;
+};
+
+//! Forward one multipart message from one socket to another.
+inline void forwardMessage(zmq::socket_t& from, zmq::socket_t& to)
+{
+  zmq::message_t msg;
+  bool more = true;
+  while (more)
+  {
+    from.recv(&msg);
+    more = msg.more();
+    to.send(msg, more ? ZMQ_SNDMORE : 0);
+  }
+}
+
+//! Forward messages between the evaluator threads of a pool and the agent.
+//!
+//! Returns once every thread has finished, after forwarding the last results
+//! and goodbyes that the threads sent.
+//!
+//! \param frontend The socket that the evaluator threads are connected to.
+//! \param backend The socket that is connected to the agent.
+//! \param running The number of evaluator threads that are still running.
+//! \param request The token on which the caller may request a stop, or null.
+//! \param stop The token that stops the evaluator threads. A stop requested
+//!             on request is passed on to it.
+//!
+inline void runBroker(zmq::socket_t& frontend, zmq::socket_t& backend,
+                      const std::atomic<unsigned int>& running,
+                      const StopToken* request, StopToken& stop)
+{
+  zmq::pollitem_t items[] = {
+    {static_cast<void*>(frontend), 0, ZMQ_POLLIN, 0},
+    {static_cast<void*>(backend), 0, ZMQ_POLLIN, 0}
+  };
+
+  while (running > 0)
+  {
+    if (request && request->stopRequested())
+      stop.requestStop();
+
+    try
+    {
+      zmq::poll(items, 2, STOP_POLL_INTERVAL);
+    }
+    catch (const zmq::error_t& e)
+    {
+      if (e.num() != EINTR)
+        throw;
+
+      continue;
+    }
+
+    if (items[0].revents & ZMQ_POLLIN)
+      forwardMessage(frontend, backend);
+
+    if (items[1].revents & ZMQ_POLLIN)
+      forwardMessage(backend, frontend);
+  }
+
+  while (zmq::poll(items, 1, 0) > 0)
+    forwardMessage(frontend, backend);
+}
+
+}
+
+//! Run a worker that evaluates jobs from an agent.
+//!
+//! Runs until a stop is requested on the stop token in the options, until the
+//! process is killed, or until the context given in the options is terminated.
+//!
+//! \param address The address of the agent.
+//! \param nll The likelihood function.
+//! \param options The worker options.
+//! \throws std::invalid_argument if the options are inconsistent.
+//!
+template <class Nll>
+void runWorker(const std::string& address, Nll nll, const WorkerOptions& options = WorkerOptions{})
+{
+  detail::checkOptions(options);
+  detail::WorkerContext ctx{options};
+  detail::MetricsReporter reporter{detail::jobTypeOptions(nll, options)};
+
+  try
+  {
+    // The first socket starts the IO threads, which would otherwise inherit
+    // the evaluator's CPU
+    detail::JobLoop<Nll> loop{ctx.get(), address, nll, reporter.options()};
+    std::cerr << "Connected to " << address << std::endl;
+
+    detail::ThreadPin pin{options.evaluatorCpus, 0};
+
+    loop.run();
+  }
+  catch (const zmq::error_t& e)
+  {
+    if (!detail::isTerminated(e))
+      throw;
+  }
+}
+
+//! Run a pool of evaluator threads inside a single worker process.
+//!
+//! All the threads share one ZMQ context and one connection to the agent.
+//! Each thread speaks the normal worker protocol to a broker over inproc, and
+//! the broker multiplexes their requests onto the agent connection, so results
+//! are returned as soon as each thread finishes its job.
+//!
+//! Runs until a stop is requested on the stop token in the options, until the
+//! process is killed, or until the context given in the options is terminated.
+//! If a thread throws, the other threads are stopped as if a stop had been
+//! requested, and the first exception is rethrown once they have finished.
+//!
+//! \param address The address of the agent.
+//! \param nll The likelihood function. It is shared by all the threads, so it
+//!            must be safe to call concurrently.
+//! \param numThreads The number of evaluator threads. Zero means one thread
+//!                   per hardware thread.
+//! \param options The worker options, shared by all the threads.
+//! \throws std::invalid_argument if the options are inconsistent.
+//!
+template <class Nll>
+void runWorkerPool(const std::string& address, Nll nll, unsigned int numThreads,
+                   const WorkerOptions& options = WorkerOptions{})
+{
+  if (numThreads == 0)
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  detail::checkOptions(options);
+  detail::WorkerContext ctx{options};
+  detail::MetricsReporter reporter{detail::jobTypeOptions(nll, options)};
+
+  // The broker must be bound before any of the evaluator threads connect. Its
+  // sockets also start the IO threads before any evaluator thread is pinned.
+  const auto poolAddress = detail::poolAddress();
+  zmq::socket_t frontend{ctx.get(), ZMQ_ROUTER};
+  frontend.setsockopt(ZMQ_LINGER, detail::LINGER_TIME);
+  frontend.bind(poolAddress);
+
+  zmq::socket_t backend{ctx.get(), ZMQ_DEALER};
+  backend.setsockopt(ZMQ_LINGER, detail::LINGER_TIME);
+  backend.connect(address);
+  std::cerr << "Connected to " << address << " with " << numThreads << " threads" << std::endl;
+
+  // The evaluator threads stop when a stop is requested in the options, or
+  // when one of them fails
+  StopToken stop;
+  WorkerOptions threadOptions = reporter.options();
+  threadOptions.stop = &stop;
+
+  std::exception_ptr error;
+  std::mutex errorMutex;
+  auto fail = [&stop, &error, &errorMutex]
+  {
+    std::lock_guard<std::mutex> lock{errorMutex};
+    if (!error)
+      error = std::current_exception();
+
+    stop.requestStop();
+  };
+
+  std::atomic<unsigned int> running{numThreads};
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < numThreads; i++)
+  {
+    threads.emplace_back([&ctx, &nll, &threadOptions, &poolAddress, &running, &fail, i]
+    {
+      try
+      {
+        detail::ThreadPin pin{threadOptions.evaluatorCpus, i};
+        detail::JobLoop<Nll> loop{ctx.get(), poolAddress, nll, threadOptions};
+        loop.run();
+      }
+      catch (const zmq::error_t& e)
+      {
+        if (!detail::isTerminated(e))
+          fail();
+      }
+      catch (...)
+      {
+        fail();
+      }
+
+      running--;
+    });
+  }
+
+  // Forward requests and replies between the evaluator threads and the agent
+  try
+  {
+    detail::runBroker(frontend, backend, running, options.stop, stop);
+  }
+  catch (const zmq::error_t& e)
+  {
+    if (!detail::isTerminated(e))
+      fail();
+  }
+  catch (...)
+  {
+    fail();
+  }
+
+  for (auto& thread : threads)
+    thread.join();
+
+  if (error)
+    std::rethrow_exception(error);
 }
 
 }
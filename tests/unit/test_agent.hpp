@@ -0,0 +1,250 @@
+//! A minimal agent and assertion helpers for the unit tests.
+//!
+//! The agent speaks the agent side of the Stateline protocol over inproc, so
+//! a worker can be tested in the same process without a real agent.
+//!
+//! \file test_agent.hpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stateline/worker.hpp>
+
+namespace test
+{
+
+//! How long the agent waits for a message from the worker, in milliseconds.
+constexpr int AGENT_TIMEOUT = 5000;
+
+//! The address that the agent of a TestWorker binds to.
+constexpr const char* AGENT_ADDRESS = "inproc://test";
+
+inline int& failures()
+{
+  static int count = 0;
+  return count;
+}
+
+//! Record a failure, and carry on with the test.
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #condition << std::endl; \
+      test::failures()++; \
+    } \
+  } while (0)
+
+//! The exit code of a test program.
+inline int result()
+{
+  if (test::failures() > 0)
+    std::cerr << test::failures() << " checks failed" << std::endl;
+
+  return test::failures() > 0 ? 1 : 0;
+}
+
+template <class T>
+void append(std::string& buf, T value)
+{
+  buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <class T>
+T read(const std::string& buf, std::size_t offset)
+{
+  if (offset + sizeof(T) > buf.size())
+    throw std::out_of_range("Read past the end of a message");
+
+  T value;
+  memcpy(&value, buf.data() + offset, sizeof(value));
+  return value;
+}
+
+//! Encode a single job.
+inline std::string job(std::uint32_t id, stateline::JobType type, const std::vector<double>& state)
+{
+  std::string buf;
+  append<std::uint8_t>(buf, 2);
+  append<std::uint32_t>(buf, id);
+  append<std::uint32_t>(buf, type);
+  for (double x : state)
+    append(buf, x);
+
+  return buf;
+}
+
+//! Encode a batch of jobs. The states are given one after another, and are
+//! sent in struct-of-arrays order.
+inline std::string batch(stateline::JobType type, const std::vector<std::uint32_t>& ids,
+                         const std::vector<std::vector<double>>& states)
+{
+  const std::size_t dim = states.empty() ? 0 : states.front().size();
+
+  std::string buf;
+  append<std::uint8_t>(buf, 10);
+  buf.append(3, '\0');
+  append<std::uint32_t>(buf, type);
+  append<std::uint32_t>(buf, dim);
+  append<std::uint32_t>(buf, ids.size());
+  for (std::uint32_t id : ids)
+    append(buf, id);
+
+  // The states start on a multiple of 8 bytes
+  if (ids.size() % 2 != 0)
+    buf.append(4, '\0');
+
+  for (std::size_t d = 0; d < dim; d++)
+    for (const auto& state : states)
+      append(buf, state[d]);
+
+  return buf;
+}
+
+//! The agent end of a worker connection.
+class TestAgent
+{
+public:
+  TestAgent(zmq::context_t& ctx, const std::string& address)
+    : socket_{ctx, ZMQ_ROUTER}
+  {
+    socket_.setsockopt(ZMQ_LINGER, 0);
+    socket_.setsockopt(ZMQ_RCVTIMEO, AGENT_TIMEOUT);
+    socket_.bind(address);
+  }
+
+  //! Receive the payload of the next message, and remember who sent it.
+  //!
+  //! \throws std::runtime_error if nothing arrives in time.
+  //!
+  std::string recv()
+  {
+    // The envelope is every frame up to and including the empty delimiter
+    envelope_.clear();
+    zmq::message_t frame;
+    while (true)
+    {
+      if (!socket_.recv(&frame))
+        throw std::runtime_error("Timed out waiting for the worker");
+
+      std::string data{static_cast<const char*>(frame.data()), frame.size()};
+      if (!frame.more())
+        return data;
+
+      envelope_.push_back(std::move(data));
+    }
+  }
+
+  //! Send a message to the sender of the last message received.
+  void send(const std::string& payload)
+  {
+    send(envelope_, payload);
+  }
+
+  //! Send a message along the route of an earlier message.
+  void send(const std::vector<std::string>& envelope, const std::string& payload)
+  {
+    for (const auto& frame : envelope)
+      socket_.send(frame.data(), frame.size(), ZMQ_SNDMORE);
+
+    socket_.send(payload.data(), payload.size());
+  }
+
+  //! The identity of the sender of the last message received.
+  const std::string& sender() const { return envelope_.front(); }
+
+  //! The route of the last message received. A worker pool adds the identity
+  //! of the evaluator thread to it.
+  const std::vector<std::string>& envelope() const { return envelope_; }
+
+  void close() { socket_.close(); }
+
+private:
+  zmq::socket_t socket_;
+  std::vector<std::string> envelope_;
+};
+
+//! Runs a worker, or a worker pool, in a background thread against a TestAgent.
+class TestWorker
+{
+public:
+  template <class Nll>
+  explicit TestWorker(Nll nll, stateline::WorkerOptions options = stateline::WorkerOptions{})
+    : agent_{ctx_, AGENT_ADDRESS}
+  {
+    options.context = &ctx_;
+    start([nll, options] { stateline::runWorker(AGENT_ADDRESS, nll, options); });
+  }
+
+  template <class Nll>
+  TestWorker(Nll nll, unsigned int numThreads, stateline::WorkerOptions options = stateline::WorkerOptions{})
+    : agent_{ctx_, AGENT_ADDRESS}
+  {
+    options.context = &ctx_;
+    start([nll, numThreads, options] { stateline::runWorkerPool(AGENT_ADDRESS, nll, numThreads, options); });
+  }
+
+  TestWorker(const TestWorker&) = delete;
+
+  //! Terminating the context stops the worker. An exception that the test
+  //! did not ask for counts as a failure.
+  ~TestWorker()
+  {
+    agent_.close();
+    ctx_.close();
+    if (thread_.joinable())
+      thread_.join();
+
+    if (error_)
+    {
+      std::cerr << "The worker threw an exception" << std::endl;
+      test::failures()++;
+    }
+  }
+
+  TestAgent& agent() { return agent_; }
+
+  //! Wait for the worker to return by itself, and take what it threw, if anything.
+  std::exception_ptr wait()
+  {
+    thread_.join();
+    return std::move(error_);
+  }
+
+private:
+  template <class Run>
+  void start(Run run)
+  {
+    thread_ = std::thread{[this, run]
+    {
+      try
+      {
+        run();
+      }
+      catch (...)
+      {
+        error_ = std::current_exception();
+      }
+    }};
+  }
+
+  zmq::context_t ctx_{1};
+  TestAgent agent_;
+  std::exception_ptr error_;
+  std::thread thread_;
+};
+
+}
@@ -0,0 +1,162 @@
+//! Tests of asynchronous likelihoods: results are sent in completion order,
+//! and no more than the allowed number of evaluations run at once.
+//!
+//! \file test_async.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "test_agent.hpp"
+
+//! The evaluations that an asynchronous likelihood has started, for the test
+//! to complete in whatever order it likes.
+struct Evaluations
+{
+  //! Wait until n evaluations have been started.
+  bool waitFor(std::size_t n)
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    return started.wait_for(lock, std::chrono::seconds(5), [this, n] { return states.size() >= n; });
+  }
+
+  //! Complete evaluation i with twice its first coordinate.
+  void complete(std::size_t i)
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    const auto done = completions[i];
+    const double result = 2 * states[i];
+    lock.unlock();
+
+    done(result);
+  }
+
+  std::size_t size()
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    return states.size();
+  }
+
+  std::mutex mutex;
+  std::condition_variable started;
+  std::vector<double> states;
+  std::vector<stateline::Completion> completions;
+};
+
+//! A likelihood that leaves its evaluations to the test.
+struct AsyncNll
+{
+  void operator()(stateline::JobType, stateline::StateView x, stateline::Completion done) const
+  {
+    {
+      std::lock_guard<std::mutex> lock{evaluations->mutex};
+      evaluations->states.push_back(x[0]);
+      evaluations->completions.push_back(done);
+    }
+
+    evaluations->started.notify_all();
+  }
+
+  std::shared_ptr<Evaluations> evaluations;
+};
+
+void checkResult(const std::string& msg, std::uint32_t id, double expected)
+{
+  CHECK(test::read<std::uint8_t>(msg, 0) == 5);
+  CHECK(test::read<std::uint32_t>(msg, 1) == id);
+  CHECK(test::read<double>(msg, 5) == expected);
+}
+
+void testCompletionOrder()
+{
+  auto evaluations = std::make_shared<Evaluations>();
+
+  stateline::WorkerOptions options;
+  options.concurrency = 3;
+  test::TestWorker worker{AsyncNll{evaluations}, options};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  // Job i has the state {i}, so evaluation i belongs to job i
+  for (std::uint32_t id = 0; id < 3; id++)
+    agent.send(test::job(id, 0, {static_cast<double>(id)}));
+
+  CHECK(evaluations->waitFor(3));
+
+  for (std::uint32_t id : {2, 0, 1})
+  {
+    evaluations->complete(id);
+    checkResult(agent.recv(), id, 2.0 * id);
+  }
+}
+
+void testConcurrency()
+{
+  auto evaluations = std::make_shared<Evaluations>();
+
+  stateline::WorkerOptions options;
+  options.concurrency = 2;
+  test::TestWorker worker{AsyncNll{evaluations}, options};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  for (std::uint32_t id = 0; id < 3; id++)
+    agent.send(test::job(id, 0, {static_cast<double>(id)}));
+
+  // The third job waits for one of the first two to complete
+  CHECK(evaluations->waitFor(2));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  CHECK(evaluations->size() == 2);
+
+  evaluations->complete(1);
+  checkResult(agent.recv(), 1, 2);
+
+  CHECK(evaluations->waitFor(3));
+  evaluations->complete(2);
+  checkResult(agent.recv(), 2, 4);
+  evaluations->complete(0);
+  checkResult(agent.recv(), 0, 0);
+}
+
+void testBatchRejected()
+{
+  auto evaluations = std::make_shared<Evaluations>();
+  test::TestWorker worker{AsyncNll{evaluations}};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  agent.send(test::batch(0, {5, 6}, {{1}, {2}}));
+  const auto result = agent.recv();
+  CHECK(test::read<std::uint8_t>(result, 0) == 11);
+  CHECK(test::read<std::uint32_t>(result, 1) == 2);
+  CHECK(std::isnan(test::read<double>(result, 13)));
+  CHECK(std::isnan(test::read<double>(result, 21)));
+  CHECK(evaluations->size() == 0);
+}
+
+//! Child processes of a likelihood do not inherit the completion pipe.
+void testPipeNotInherited()
+{
+  stateline::detail::CompletionQueue queue;
+  CHECK((::fcntl(queue.fd(), F_GETFD) & FD_CLOEXEC) != 0);
+  CHECK((::fcntl(queue.fd(), F_GETFL) & O_NONBLOCK) != 0);
+}
+
+int main()
+{
+  testCompletionOrder();
+  testConcurrency();
+  testBatchRejected();
+  testPipeNotInherited();
+  return test::result();
+}
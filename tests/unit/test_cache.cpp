@@ -0,0 +1,130 @@
+//! Tests of the result cache: hit, miss and eviction counts, on its own and
+//! in a worker.
+//!
+//! \file test_cache.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "test_agent.hpp"
+
+const char* bytes(const std::vector<double>& state)
+{
+  return reinterpret_cast<const char*>(state.data());
+}
+
+void testCounts()
+{
+  stateline::ResultCache cache{1 << 16};
+  const std::vector<double> state{1, 2, 3};
+  double result = 0;
+
+  CHECK(!cache.find(0, bytes(state), state.size(), result));
+  CHECK(cache.hits() == 0);
+  CHECK(cache.misses() == 1);
+
+  cache.insert(0, bytes(state), state.size(), 4.5);
+  CHECK(cache.find(0, bytes(state), state.size(), result));
+  CHECK(result == 4.5);
+  CHECK(cache.hits() == 1);
+
+  // The key is the job type and the exact state
+  const std::vector<double> other{1, 2, 4};
+  CHECK(!cache.find(1, bytes(state), state.size(), result));
+  CHECK(!cache.find(0, bytes(other), other.size(), result));
+  CHECK(!cache.find(0, bytes(state), 2, result));
+  CHECK(cache.hits() == 1);
+  CHECK(cache.misses() == 4);
+
+  // Storing the same state again replaces its result in place
+  cache.insert(0, bytes(state), state.size(), 5.5);
+  CHECK(cache.find(0, bytes(state), state.size(), result));
+  CHECK(result == 5.5);
+  CHECK(cache.evictions() == 0);
+}
+
+void testEviction()
+{
+  stateline::ResultCache cache{4096};
+
+  std::vector<std::vector<double>> states;
+  for (int i = 0; i < 1000; i++)
+    states.push_back({static_cast<double>(i), -1.0});
+
+  for (std::size_t i = 0; i < states.size(); i++)
+    cache.insert(0, bytes(states[i]), 2, static_cast<double>(i));
+
+  const std::size_t capacity = cache.capacity();
+  CHECK(capacity > 0);
+  CHECK(capacity < states.size());
+  CHECK(cache.evictions() >= states.size() - capacity);
+  CHECK(cache.evictions() < states.size());
+
+  // Only what fits is still cached, and it has the right results
+  std::size_t found = 0;
+  for (std::size_t i = 0; i < states.size(); i++)
+  {
+    double result;
+    if (cache.find(0, bytes(states[i]), 2, result))
+    {
+      CHECK(result == static_cast<double>(i));
+      found++;
+    }
+  }
+
+  CHECK(found > 0);
+  CHECK(found <= capacity);
+  CHECK(cache.hits() == found);
+  CHECK(cache.misses() == states.size() - found);
+
+  // The latest result is never the one evicted
+  double result;
+  CHECK(cache.find(0, bytes(states.back()), 2, result));
+}
+
+void testWorker()
+{
+  auto cache = std::make_shared<stateline::ResultCache>(1 << 16);
+  auto calls = std::make_shared<std::atomic<int>>(0);
+
+  stateline::WorkerOptions options;
+  options.cache = cache.get();
+
+  test::TestWorker worker{[calls](stateline::JobType, const std::vector<double>& x)
+  {
+    (*calls)++;
+    return x[0] + x[1];
+  }, options};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  // The same state twice, then a new one
+  const std::vector<std::vector<double>> states{{1, 2}, {1, 2}, {2, 2}};
+  for (std::uint32_t id = 0; id < states.size(); id++)
+  {
+    agent.send(test::job(id, 0, states[id]));
+
+    const auto result = agent.recv();
+    CHECK(test::read<std::uint8_t>(result, 0) == 5);
+    CHECK(test::read<std::uint32_t>(result, 1) == id);
+    CHECK(test::read<double>(result, 5) == states[id][0] + states[id][1]);
+  }
+
+  CHECK(*calls == 2);
+  CHECK(cache->hits() == 1);
+  CHECK(cache->misses() == 2);
+}
+
+int main()
+{
+  testCounts();
+  testEviction();
+  testWorker();
+  return test::result();
+}
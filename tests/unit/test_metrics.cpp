@@ -0,0 +1,156 @@
+//! Tests of the worker metrics: latency buckets, the percentiles of a merged
+//! snapshot, and the JSON lines that report them.
+//!
+//! \file test_metrics.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+
+#include "test_agent.hpp"
+
+using stateline::detail::latencyBucket;
+using stateline::detail::latencyBucketMidpoint;
+
+//! The microseconds that a latency is reported as.
+double reported(std::uint64_t ns)
+{
+  return latencyBucketMidpoint(latencyBucket(ns)) * 1e-3;
+}
+
+void testBuckets()
+{
+  // Below 2^SUB_BUCKET_BITS every nanosecond has its own bucket
+  CHECK(latencyBucket(0) == 0);
+  CHECK(latencyBucket(7) == 7);
+  CHECK(latencyBucket(8) == 8);
+  CHECK(latencyBucket(9) == 9);
+  CHECK(latencyBucket(15) == 15);
+  CHECK(latencyBucket(16) == 16);
+  CHECK(latencyBucket(17) == 16);
+  CHECK(latencyBucketMidpoint(7) == 7);
+  CHECK(latencyBucketMidpoint(8) == 8);
+  CHECK(latencyBucketMidpoint(16) == 16.5);
+
+  // The last power of two range fills the last buckets, and anything longer
+  // is clamped to the last one
+  const std::uint64_t top = std::uint64_t{1} << 41;
+  const std::size_t last = stateline::detail::NUM_LATENCY_BUCKETS - 1;
+  CHECK(latencyBucket(top - 1) == last - 8);
+  CHECK(latencyBucket(top) == last - 7);
+  CHECK(latencyBucket(2 * top - 1) == last);
+  CHECK(latencyBucket(2 * top) == last);
+  CHECK(latencyBucket(UINT64_MAX) == last);
+  CHECK(latencyBucketMidpoint(last - 7) == top + ((top >> 3) - 1) / 2.0);
+
+  // Every bucket holds its own midpoint, with an error of at most 1/16
+  for (std::size_t b = 0; b < stateline::detail::NUM_LATENCY_BUCKETS; b++)
+  {
+    const double mid = latencyBucketMidpoint(b);
+    CHECK(latencyBucket(static_cast<std::uint64_t>(mid)) == b);
+  }
+
+  for (std::uint64_t ns : {100, 1000, 12345, 1000000, 987654321})
+    CHECK(std::abs(reported(ns) * 1e3 - ns) <= ns / 16.0);
+}
+
+//! Percentiles are taken over the histograms of all the shards.
+void testPercentiles()
+{
+  stateline::WorkerMetrics metrics{2, 5};
+  auto& first = metrics.addShard();
+  auto& second = metrics.addShard();
+
+  // 50 jobs at 1us, 40 at 2us, 9 at 4us and 1 at 64us, split over the shards
+  auto record = [](stateline::detail::MetricsShard& shard, std::uint64_t ns, int n)
+  {
+    auto* type = shard.find(3);
+    for (int i = 0; i < n; i++)
+      type->nll.record(ns);
+
+    type->jobs += n;
+    shard.jobs += n;
+  };
+
+  record(first, 1000, 30);
+  record(second, 1000, 20);
+  record(first, 2000, 40);
+  record(second, 4000, 9);
+  record(second, 64000, 1);
+
+  const auto snapshot = metrics.snapshot();
+  CHECK(snapshot.jobs == 100);
+
+  // Types without jobs are left out
+  CHECK(snapshot.types.size() == 1);
+  const auto& type = snapshot.types.front();
+  CHECK(type.type == 3);
+  CHECK(type.jobs == 100);
+  CHECK(type.recv.count == 0);
+
+  const auto& nll = type.nll;
+  CHECK(nll.count == 100);
+  CHECK(nll.p50 == reported(1000));
+  CHECK(nll.p90 == reported(2000));
+  CHECK(nll.p99 == reported(4000));
+  CHECK(nll.max == reported(64000));
+
+  const double mean = (50 * reported(1000) + 40 * reported(2000) + 9 * reported(4000) + reported(64000)) / 100;
+  CHECK(std::abs(nll.mean - mean) < 1e-9);
+
+  // Types outside the range are not tracked
+  CHECK(first.find(1) == nullptr);
+  CHECK(first.find(6) == nullptr);
+}
+
+void testJsonLines()
+{
+  stateline::MetricsSnapshot snapshot;
+  snapshot.uptime = 2;
+  snapshot.jobs = 10;
+  snapshot.bytesIn = 100;
+  snapshot.bytesOut = 50;
+  snapshot.idle = 0.5;
+
+  stateline::LatencySummary nll;
+  nll.count = 10;
+  nll.mean = 1.5;
+  nll.p50 = 1;
+  nll.p90 = 2;
+  nll.p99 = 4;
+  nll.max = 8;
+  snapshot.types.push_back({3, 10, stateline::LatencySummary{}, nll, stateline::LatencySummary{}});
+
+  std::ostringstream out;
+  stateline::JsonMetricsWriter writer{out};
+  writer(snapshot);
+
+  const std::string empty = "{\"count\":0,\"mean\":0,\"p50\":0,\"p90\":0,\"p99\":0,\"max\":0}";
+  CHECK(out.str() ==
+        "{\"uptime\":2,\"jobs\":10,\"jobs_per_sec\":5,\"bytes_in\":100,\"bytes_out\":50,\"idle\":0.5,"
+        "\"types\":[{\"type\":3,\"jobs\":10,\"recv_us\":" + empty +
+        ",\"nll_us\":{\"count\":10,\"mean\":1.5,\"p50\":1,\"p90\":2,\"p99\":4,\"max\":8}"
+        ",\"send_us\":" + empty + "}]}\n");
+
+  // The throughput is over the time since the previous line
+  out.str("");
+  snapshot.uptime = 6;
+  snapshot.jobs = 30;
+  snapshot.types.clear();
+  writer(snapshot);
+  CHECK(out.str() ==
+        "{\"uptime\":6,\"jobs\":30,\"jobs_per_sec\":5,\"bytes_in\":100,\"bytes_out\":50,\"idle\":0.5,"
+        "\"types\":[]}\n");
+}
+
+int main()
+{
+  testBuckets();
+  testPercentiles();
+  testJsonLines();
+  return test::result();
+}
@@ -0,0 +1,143 @@
+//! Tests of likelihoods with one model per job type: when the models are
+//! built, how copies share them, and how a worker uses their range.
+//!
+//! \file test_models.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "test_agent.hpp"
+
+//! Builds models that scale the first coordinate by their job type, counting
+//! how often each type is built.
+struct Factory
+{
+  std::function<double(const std::vector<double>&)> operator()(stateline::JobType type) const
+  {
+    (*builds)[type]++;
+    return [type](const std::vector<double>& x) { return type * x[0]; };
+  }
+
+  std::shared_ptr<std::vector<std::atomic<int>>> builds =
+    std::make_shared<std::vector<std::atomic<int>>>(8);
+};
+
+void testLazy()
+{
+  Factory factory;
+  auto nll = stateline::perJobType(2, 5, factory);
+  for (int type = 0; type < 8; type++)
+    CHECK((*factory.builds)[type] == 0);
+
+  CHECK(nll(3, std::vector<double>{1.5}) == 4.5);
+  CHECK(nll(3, std::vector<double>{2}) == 6);
+  CHECK((*factory.builds)[3] == 1);
+  CHECK((*factory.builds)[4] == 0);
+}
+
+void testEager()
+{
+  Factory factory;
+  auto nll = stateline::perJobType(2, 5, factory, stateline::ModelInit::Eager);
+  for (int type = 0; type < 8; type++)
+    CHECK((*factory.builds)[type] == (type >= 2 && type <= 5 ? 1 : 0));
+
+  CHECK(nll(5, std::vector<double>{1}) == 5);
+  CHECK((*factory.builds)[5] == 1);
+}
+
+//! Copies share their models, which are built once however many threads ask
+//! for them at the same time.
+void testShared()
+{
+  Factory factory;
+  auto nll = stateline::perJobType(2, 5, factory);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++)
+  {
+    threads.emplace_back([nll]() mutable
+    {
+      for (stateline::JobType type = 2; type <= 5; type++)
+        nll(type, std::vector<double>{1});
+    });
+  }
+
+  for (auto& thread : threads)
+    thread.join();
+
+  for (stateline::JobType type = 2; type <= 5; type++)
+    CHECK((*factory.builds)[type] == 1);
+
+  auto copy = nll;
+  CHECK(&copy.model(4) == &nll.model(4));
+  CHECK((*factory.builds)[4] == 1);
+
+  bool thrown = false;
+  try
+  {
+    nll.model(6);
+  }
+  catch (const stateline::UnknownJobType&)
+  {
+    thrown = true;
+  }
+
+  CHECK(thrown);
+}
+
+//! The worker asks for the types that it has models for, and answers jobs of
+//! other types with NaN.
+void testWorker()
+{
+  Factory factory;
+
+  stateline::WorkerOptions options;
+  options.jobTypeFrom = 0;
+  options.jobTypeTo = 7;
+  options.maxBatch = 4;
+  test::TestWorker worker{stateline::perJobType(2, 5, factory), options};
+
+  auto& agent = worker.agent();
+  const auto hello = agent.recv();
+  CHECK(test::read<std::uint32_t>(hello, 1) == 2);
+  CHECK(test::read<std::uint32_t>(hello, 5) == 5);
+
+  agent.send(test::job(1, 7, {1}));
+  auto result = agent.recv();
+  CHECK(test::read<std::uint8_t>(result, 0) == 5);
+  CHECK(test::read<std::uint32_t>(result, 1) == 1);
+  CHECK(std::isnan(test::read<double>(result, 5)));
+
+  agent.send(test::batch(1, {2, 3}, {{1}, {2}}));
+  result = agent.recv();
+  CHECK(test::read<std::uint8_t>(result, 0) == 11);
+  CHECK(test::read<std::uint32_t>(result, 1) == 2);
+  CHECK(test::read<std::uint32_t>(result, 5) == 2);
+  CHECK(test::read<std::uint32_t>(result, 9) == 3);
+  CHECK(std::isnan(test::read<double>(result, 13)));
+  CHECK(std::isnan(test::read<double>(result, 21)));
+
+  // The worker carries on with the types that it has models for
+  agent.send(test::job(4, 3, {2}));
+  result = agent.recv();
+  CHECK(test::read<std::uint32_t>(result, 1) == 4);
+  CHECK(test::read<double>(result, 5) == 6);
+}
+
+int main()
+{
+  testLazy();
+  testEager();
+  testShared();
+  testWorker();
+  return test::result();
+}
@@ -0,0 +1,112 @@
+//! Tests of a worker pool: every evaluator thread gets its own route through
+//! the broker, and a thread that throws stops the whole pool.
+//!
+//! \file test_pool.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include "test_agent.hpp"
+
+//! Each thread says hello along its own route, and the result of a job comes
+//! back along the route that it was sent on.
+void testRouting()
+{
+  const unsigned int numThreads = 3;
+  test::TestWorker worker{[](stateline::JobType type, const std::vector<double>& x) { return type + x[0]; },
+                          numThreads};
+
+  auto& agent = worker.agent();
+  std::vector<std::vector<std::string>> routes;
+  for (unsigned int i = 0; i < numThreads; i++)
+  {
+    const auto hello = agent.recv();
+    CHECK(test::read<std::uint8_t>(hello, 0) == 1);
+    routes.push_back(agent.envelope());
+  }
+
+  // The pool has one connection, with a separate identity for each thread
+  std::set<std::string> threads;
+  for (const auto& route : routes)
+  {
+    CHECK(route.size() == 3);
+    CHECK(route.front() == routes.front().front());
+    threads.insert(route[1]);
+  }
+
+  CHECK(threads.size() == numThreads);
+
+  // Job i goes to thread i, so every thread has a job at the same time
+  for (std::uint32_t id = 0; id < numThreads; id++)
+    agent.send(routes[id], test::job(id, 10 * id, {0.5}));
+
+  std::set<std::uint32_t> answered;
+  for (unsigned int i = 0; i < numThreads; i++)
+  {
+    const auto result = agent.recv();
+    CHECK(test::read<std::uint8_t>(result, 0) == 5);
+
+    const auto id = test::read<std::uint32_t>(result, 1);
+    CHECK(id < numThreads);
+    CHECK(agent.envelope() == routes[id]);
+    CHECK(test::read<double>(result, 5) == 10.0 * id + 0.5);
+    answered.insert(id);
+  }
+
+  CHECK(answered.size() == numThreads);
+}
+
+//! A likelihood that throws stops the other threads, and the pool rethrows
+//! the exception once they have said goodbye.
+void testThrowingNll()
+{
+  test::TestWorker worker{[](stateline::JobType, const std::vector<double>& x)
+  {
+    if (x[0] < 0)
+      throw std::domain_error("Negative state");
+
+    return x[0];
+  }, 2};
+
+  auto& agent = worker.agent();
+  std::vector<std::vector<std::string>> routes;
+  for (int i = 0; i < 2; i++)
+  {
+    agent.recv();
+    routes.push_back(agent.envelope());
+  }
+
+  agent.send(routes[0], test::job(1, 0, {-1}));
+
+  // The thread that did not throw leaves as if a stop had been requested
+  CHECK(agent.recv() == std::string(1, '\x09'));
+  CHECK(agent.envelope() == routes[1]);
+
+  const auto error = worker.wait();
+  CHECK(error);
+
+  try
+  {
+    std::rethrow_exception(error);
+  }
+  catch (const std::domain_error& e)
+  {
+    CHECK(std::string{e.what()} == "Negative state");
+  }
+  catch (...)
+  {
+    CHECK(false);
+  }
+}
+
+int main()
+{
+  testRouting();
+  testThrowingNll();
+  return test::result();
+}
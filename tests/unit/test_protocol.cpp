@@ -0,0 +1,278 @@
+//! Tests of how a worker decodes jobs and batches, and how it answers
+//! malformed ones.
+//!
+//! \file test_protocol.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "test_agent.hpp"
+
+double sum(stateline::JobType type, const std::vector<double>& x)
+{
+  double result = type;
+  for (std::size_t i = 0; i < x.size(); i++)
+    result += (i + 1) * x[i];
+
+  return result;
+}
+
+//! Check that a message is the result of a single job.
+void checkResult(const std::string& msg, std::uint32_t id, double expected)
+{
+  CHECK(msg.size() == 13);
+  CHECK(test::read<std::uint8_t>(msg, 0) == 5);
+  CHECK(test::read<std::uint32_t>(msg, 1) == id);
+
+  const double result = test::read<double>(msg, 5);
+  CHECK(std::isnan(expected) ? std::isnan(result) : result == expected);
+}
+
+//! Check that a message is the result of a batch.
+void checkBatchResult(const std::string& msg, const std::vector<std::uint32_t>& ids,
+                      const std::vector<double>& expected)
+{
+  const std::size_t count = ids.size();
+  CHECK(msg.size() == 5 + count * (sizeof(std::uint32_t) + sizeof(double)));
+  CHECK(test::read<std::uint8_t>(msg, 0) == 11);
+  CHECK(test::read<std::uint32_t>(msg, 1) == count);
+
+  for (std::size_t i = 0; i < count; i++)
+  {
+    CHECK(test::read<std::uint32_t>(msg, 5 + i * sizeof(std::uint32_t)) == ids[i]);
+
+    const double result = test::read<double>(msg, 5 + count * sizeof(std::uint32_t) + i * sizeof(double));
+    CHECK(std::isnan(expected[i]) ? std::isnan(result) : result == expected[i]);
+  }
+}
+
+//! Jobs and batches whose IDs can be read get NaN results, so the agent is
+//! not left waiting on them.
+void testOversized()
+{
+  stateline::WorkerOptions options;
+  options.prefetch = 4;
+  options.maxBatch = 4;
+  test::TestWorker worker{sum, options};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  // A job with a stray byte after its state
+  agent.send(test::job(7, 0, {1, 2}) + "x");
+  checkResult(agent.recv(), 7, NAN);
+
+  // A batch with more doubles than its jobs need
+  agent.send(test::batch(0, {11, 12}, {{1, 2}, {3, 4}}) + std::string(8, '\0'));
+  checkBatchResult(agent.recv(), {11, 12}, {NAN, NAN});
+
+  // A batch with fewer doubles than its jobs need
+  auto batch = test::batch(0, {13, 14}, {{1, 2}, {3, 4}});
+  batch.resize(batch.size() - 8);
+  agent.send(batch);
+  checkBatchResult(agent.recv(), {13, 14}, {NAN, NAN});
+
+  // The worker carries on as before
+  agent.send(test::job(8, 2, {1, 2}));
+  checkResult(agent.recv(), 8, 7);
+}
+
+//! Messages too short to hold the job IDs make the worker start over.
+void testTruncated()
+{
+  test::TestWorker worker{sum};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  std::string job = test::job(1, 0, {});
+  job.resize(job.size() - 1);
+
+  std::string batch = test::batch(0, {1, 2}, {{1}, {2}});
+  batch.resize(16 + 4);
+
+  for (const auto& msg : {std::string{}, std::string(1, '\x63'), job, batch})
+  {
+    const std::string sender = agent.sender();
+    agent.send(msg);
+
+    // The worker says hello again, from a new connection
+    const auto hello = agent.recv();
+    CHECK(test::read<std::uint8_t>(hello, 0) == 1);
+    CHECK(agent.sender() != sender);
+  }
+
+  agent.send(test::job(3, 1, {2}));
+  checkResult(agent.recv(), 3, 3);
+}
+
+//! The states of a batch arrive in struct-of-arrays order, and the results go
+//! back in the order of the job IDs.
+void testBatchLayout()
+{
+  const std::vector<std::uint32_t> ids{4, 9, 2};
+  const std::vector<std::vector<double>> states{{1, 2, 3}, {4, 5, 6}, {7, 8, 9}};
+
+  std::vector<double> expected;
+  for (const auto& state : states)
+    expected.push_back(sum(5, state));
+
+  // With a batch overload, the whole batch is evaluated in one call
+  auto seen = std::make_shared<std::vector<double>>();
+  auto nllBatch = [seen](stateline::JobType type, const double* x, std::size_t dim, std::size_t n, double* out)
+  {
+    seen->assign(x, x + dim * n);
+    for (std::size_t i = 0; i < n; i++)
+    {
+      out[i] = type;
+      for (std::size_t d = 0; d < dim; d++)
+        out[i] += (d + 1) * x[d * n + i];
+    }
+  };
+
+  {
+    stateline::WorkerOptions options;
+    options.maxBatch = 4;
+    test::TestWorker worker{stateline::withBatch(sum, nllBatch), options};
+
+    auto& agent = worker.agent();
+    agent.recv();
+    agent.send(test::batch(5, ids, states));
+    checkBatchResult(agent.recv(), ids, expected);
+  }
+
+  CHECK((*seen == std::vector<double>{1, 4, 7, 2, 5, 8, 3, 6, 9}));
+
+  // Without one, the states are taken apart and evaluated one at a time
+  {
+    test::TestWorker worker{sum};
+
+    auto& agent = worker.agent();
+    agent.recv();
+    agent.send(test::batch(5, ids, states));
+    checkBatchResult(agent.recv(), ids, expected);
+  }
+}
+
+//! Jobs small enough to be stored inside their zmq::message_t keep their
+//! states while they are moved through the prefetch queue.
+void testSmallJobs()
+{
+  const std::vector<double> states{42.5, 7.25, 3};
+
+  stateline::WorkerOptions options;
+  options.prefetch = 4;
+  test::TestWorker worker{[](stateline::JobType, stateline::StateView x) { return x[0]; }, options};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  for (std::uint32_t id = 0; id < states.size(); id++)
+    agent.send(test::job(id, 0, {states[id]}));
+
+  for (std::uint32_t id = 0; id < states.size(); id++)
+    checkResult(agent.recv(), id, states[id]);
+}
+
+//! A likelihood that returns its gradient says so in its hello, and sends its
+//! results as [u8 12][u32 id][double nll][double gradient x dim].
+void testGradient()
+{
+  stateline::WorkerOptions options;
+  options.jobTypeFrom = 2;
+  options.jobTypeTo = 5;
+  options.prefetch = 3;
+  options.maxBatch = 4;
+  test::TestWorker worker{[](stateline::JobType type, stateline::StateView x, double* gradient)
+  {
+    double result = type;
+    for (std::size_t i = 0; i < x.size(); i++)
+    {
+      result += (i + 1) * x[i];
+      gradient[i] = i + 1;
+    }
+
+    return result;
+  }, options};
+
+  // The capability flags follow the extended hello. Batches have no
+  // gradients, so none are asked for.
+  auto& agent = worker.agent();
+  const auto hello = agent.recv();
+  CHECK(hello.size() == 21);
+  CHECK(test::read<std::uint8_t>(hello, 0) == 1);
+  CHECK(test::read<std::uint32_t>(hello, 1) == 2);
+  CHECK(test::read<std::uint32_t>(hello, 5) == 5);
+  CHECK(test::read<std::uint32_t>(hello, 9) == 3);
+  CHECK(test::read<std::uint32_t>(hello, 13) == 1);
+  CHECK(test::read<std::uint32_t>(hello, 17) == 1);
+
+  agent.send(test::job(6, 3, {1, 2, 3}));
+  const auto result = agent.recv();
+  CHECK(result.size() == 13 + 3 * sizeof(double));
+  CHECK(test::read<std::uint8_t>(result, 0) == 12);
+  CHECK(test::read<std::uint32_t>(result, 1) == 6);
+  CHECK(test::read<double>(result, 5) == sum(3, {1, 2, 3}));
+  for (std::size_t i = 0; i < 3; i++)
+    CHECK(test::read<double>(result, 13 + i * sizeof(double)) == i + 1);
+
+  // A malformed job gets a NaN result with an empty gradient
+  agent.send(test::job(7, 3, {1, 2, 3}) + "x");
+  const auto rejected = agent.recv();
+  CHECK(rejected.size() == 13);
+  CHECK(test::read<std::uint8_t>(rejected, 0) == 12);
+  CHECK(test::read<std::uint32_t>(rejected, 1) == 7);
+  CHECK(std::isnan(test::read<double>(rejected, 5)));
+}
+
+//! Hands a message handler one message at a time.
+struct FakeSocket
+{
+  zmq::message_t recv() { return std::move(next); }
+  void send(const char*, std::size_t) {}
+  void send(zmq::message_t&) {}
+
+  zmq::message_t next;
+};
+
+//! The states of a batch stay as aligned as the message, so that they can be
+//! read in place, whether the number of job IDs is odd or even.
+void testBatchAlignment()
+{
+  FakeSocket socket;
+  stateline::detail::MessageHandler<FakeSocket> handler{socket};
+
+  for (std::size_t count = 1; count <= 4; count++)
+  {
+    std::vector<std::uint32_t> ids(count);
+    std::vector<std::vector<double>> states(count, std::vector<double>{1, 2});
+    const auto batch = test::batch(0, ids, states);
+    socket.next.rebuild(batch.size());
+    memcpy(socket.next.data(), batch.data(), batch.size());
+
+    stateline::detail::Job job;
+    std::size_t bytes;
+    CHECK(handler.recvJob(job, bytes));
+    CHECK(job.count == count);
+    CHECK((job.data() - static_cast<const char*>(job.msg.data())) % sizeof(double) == 0);
+    CHECK(stateline::detail::isAligned(static_cast<const char*>(job.msg.data())) ==
+          stateline::detail::isAligned(job.data()));
+  }
+}
+
+int main()
+{
+  testOversized();
+  testTruncated();
+  testBatchLayout();
+  testBatchAlignment();
+  testSmallJobs();
+  testGradient();
+  return test::result();
+}
@@ -0,0 +1,203 @@
+//! Tests of stopping a worker, of heartbeats and of reconnecting to a silent
+//! agent.
+//!
+//! \file test_shutdown.cpp
+//! \date 2026
+//! \license Lesser General Public License version 3 or later
+//! \copyright (c) 2014, NICTA
+//!
+
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include "test_agent.hpp"
+
+using std::chrono::milliseconds;
+
+//! Holds the first evaluation until the test lets it go.
+struct Gate
+{
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    entered = true;
+    changed.notify_all();
+    changed.wait(lock, [this] { return opened; });
+  }
+
+  bool waitForEntry()
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    return changed.wait_for(lock, std::chrono::seconds(5), [this] { return entered; });
+  }
+
+  void open()
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    opened = true;
+    changed.notify_all();
+  }
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool entered = false;
+  bool opened = false;
+};
+
+//! A stopped worker finishes the jobs it has queued, then says goodbye.
+void testStop()
+{
+  auto gate = std::make_shared<Gate>();
+  stateline::StopToken stop;
+
+  stateline::WorkerOptions options;
+  options.prefetch = 4;
+  options.stop = &stop;
+  test::TestWorker worker{[gate](stateline::JobType, const std::vector<double>& x)
+  {
+    if (x[0] == 0)
+      gate->wait();
+
+    return 10 * x[0];
+  }, options};
+
+  auto& agent = worker.agent();
+  agent.recv();
+
+  for (std::uint32_t id = 0; id < 4; id++)
+    agent.send(test::job(id, 0, {static_cast<double>(id)}));
+
+  // Stop while the first job is running and the others are queued
+  CHECK(gate->waitForEntry());
+  stop.requestStop();
+  gate->open();
+
+  for (std::uint32_t id = 0; id < 4; id++)
+  {
+    const auto result = agent.recv();
+    CHECK(test::read<std::uint8_t>(result, 0) == 5);
+    CHECK(test::read<std::uint32_t>(result, 1) == id);
+    CHECK(test::read<double>(result, 5) == 10.0 * id);
+  }
+
+  CHECK(agent.recv() == std::string(1, '\x09'));
+}
+
+//! A worker whose heartbeats go unanswered starts over with a new connection.
+void testReconnect()
+{
+  stateline::WorkerOptions options;
+  options.heartbeatInterval = milliseconds(20);
+  options.reconnectTimeout = milliseconds(100);
+  test::TestWorker worker{[](stateline::JobType, const std::vector<double>& x) { return x[0]; }, options};
+
+  auto& agent = worker.agent();
+  CHECK(test::read<std::uint8_t>(agent.recv(), 0) == 1);
+  const std::string sender = agent.sender();
+
+  int heartbeats = 0;
+  std::string msg;
+  while ((msg = agent.recv()) == std::string(1, '\x08'))
+    heartbeats++;
+
+  CHECK(heartbeats >= 2);
+  CHECK(test::read<std::uint8_t>(msg, 0) == 1);
+  CHECK(agent.sender() != sender);
+
+  // The new connection works as before
+  agent.send(test::job(1, 0, {2.5}));
+  while ((msg = agent.recv()) == std::string(1, '\x08'))
+    ;
+
+  CHECK(test::read<std::uint8_t>(msg, 0) == 5);
+  CHECK(test::read<double>(msg, 5) == 2.5);
+}
+
+//! A worker whose heartbeats are answered stays connected.
+void testHeartbeats()
+{
+  stateline::WorkerOptions options;
+  options.heartbeatInterval = milliseconds(20);
+  options.reconnectTimeout = milliseconds(100);
+  test::TestWorker worker{[](stateline::JobType, const std::vector<double>& x) { return x[0]; }, options};
+
+  auto& agent = worker.agent();
+  agent.recv();
+  const std::string sender = agent.sender();
+
+  const auto end = std::chrono::steady_clock::now() + milliseconds(300);
+  while (std::chrono::steady_clock::now() < end)
+  {
+    CHECK(agent.recv() == std::string(1, '\x08'));
+    CHECK(agent.sender() == sender);
+    agent.send(std::string(1, '\x08'));
+  }
+}
+
+bool rejects(int heartbeatMs, int timeoutMs)
+{
+  stateline::WorkerOptions options;
+  options.heartbeatInterval = milliseconds(heartbeatMs);
+  options.reconnectTimeout = milliseconds(timeoutMs);
+
+  try
+  {
+    stateline::detail::checkOptions(options);
+    return false;
+  }
+  catch (const std::invalid_argument&)
+  {
+    return true;
+  }
+}
+
+void testOptions()
+{
+  CHECK(rejects(0, 100));
+  CHECK(rejects(100, 100));
+  CHECK(rejects(200, 100));
+  CHECK(!rejects(50, 100));
+  CHECK(!rejects(0, 0));
+  CHECK(!rejects(200, 0));
+}
+
+int previousHandlerCalls = 0;
+
+void previousHandler(int)
+{
+  previousHandlerCalls++;
+}
+
+//! A signal guard stops its token while it lives, and then puts the previous
+//! handler back.
+void testSignalGuard()
+{
+  std::signal(SIGUSR1, previousHandler);
+
+  {
+    stateline::StopToken stop;
+    stateline::StopSignalGuard guard{stop, {SIGUSR1}};
+
+    std::raise(SIGUSR1);
+    CHECK(stop.stopRequested());
+    CHECK(previousHandlerCalls == 0);
+  }
+
+  std::raise(SIGUSR1);
+  CHECK(previousHandlerCalls == 1);
+  CHECK(stateline::detail::signalStopToken().load() == nullptr);
+}
+
+int main()
+{
+  testStop();
+  testReconnect();
+  testHeartbeats();
+  testOptions();
+  testSignalGuard();
+  return test::result();
+}